@@ -0,0 +1,257 @@
+#include "aead.h"
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <openssl/crypto.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+// --- Key exchange ---
+
+static int x25519_public(const uint8_t *priv, uint8_t *pub) {
+    EVP_PKEY *pk = EVP_PKEY_new_raw_private_key(EVP_PKEY_X25519, NULL, priv, AEAD_SHARE_LEN);
+    if (!pk) return -1;
+    size_t len = AEAD_SHARE_LEN;
+    int ok = EVP_PKEY_get_raw_public_key(pk, pub, &len) == 1;
+    EVP_PKEY_free(pk);
+    return ok ? 0 : -1;
+}
+
+static int x25519(const uint8_t *priv, const uint8_t *peer_pub, uint8_t *out) {
+    EVP_PKEY *pk = EVP_PKEY_new_raw_private_key(EVP_PKEY_X25519, NULL, priv, AEAD_SHARE_LEN);
+    EVP_PKEY *peer = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, peer_pub, AEAD_SHARE_LEN);
+    EVP_PKEY_CTX *ctx = pk ? EVP_PKEY_CTX_new(pk, NULL) : NULL;
+    size_t len = AEAD_SHARE_LEN;
+    int ok = peer && ctx && EVP_PKEY_derive_init(ctx) == 1 && EVP_PKEY_derive_set_peer(ctx, peer) == 1 &&
+             EVP_PKEY_derive(ctx, out, &len) == 1;
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(peer);
+    EVP_PKEY_free(pk);
+    return ok ? 0 : -1;
+}
+
+int aead_keygen(uint8_t priv[AEAD_SHARE_LEN], uint8_t pub[AEAD_SHARE_LEN]) {
+    if (RAND_bytes(priv, AEAD_SHARE_LEN) != 1) return -1;
+    return x25519_public(priv, pub);
+}
+
+// The listener's key pair for one handshake, recomputed from the packet
+// that completes it. 'secret' is the short-lived handshake secret of the
+// cookie slot the handshake began in, never the listener key.
+int aead_server_keypair(const uint8_t *secret, const struct sockaddr_in *peer, uint32_t client_isn,
+                        uint32_t server_isn, uint8_t priv[AEAD_SHARE_LEN], uint8_t pub[AEAD_SHARE_LEN]) {
+    uint8_t msg[2 + 4 + 2 + 8];
+    uint32_t v;
+    memcpy(msg, "kx", 2);
+    memcpy(msg + 2, &peer->sin_addr.s_addr, 4);
+    memcpy(msg + 6, &peer->sin_port, 2);
+    v = htonl(client_isn);
+    memcpy(msg + 8, &v, 4);
+    v = htonl(server_isn);
+    memcpy(msg + 12, &v, 4);
+
+    unsigned int len = AEAD_SHARE_LEN;
+    HMAC(EVP_sha256(), secret, 32, msg, sizeof(msg), priv, &len);
+    return x25519_public(priv, pub);
+}
+
+// HKDF-SHA256 (RFC 5869); 'info' is at most 128 bytes here
+static void hkdf(const uint8_t *salt, size_t salt_len, const uint8_t *ikm, size_t ikm_len, const uint8_t *info,
+                 size_t info_len, uint8_t *out, size_t len) {
+    uint8_t prk[32], block[32 + 128 + 1];
+    unsigned int n = sizeof(prk);
+    HMAC(EVP_sha256(), salt, (int)salt_len, ikm, ikm_len, prk, &n);
+
+    // T(i) = HMAC(PRK, T(i-1) | info | i), with T(0) empty
+    size_t done = 0, prev = 0;
+    for (uint8_t i = 1; done < len; i++) {
+        memcpy(block + prev, info, info_len);
+        block[prev + info_len] = i;
+        HMAC(EVP_sha256(), prk, sizeof(prk), block, prev + info_len + 1, block, &n);
+        prev = 32;
+        size_t chunk = len - done < 32 ? len - done : 32;
+        memcpy(out + done, block, chunk);
+        done += chunk;
+    }
+    OPENSSL_cleanse(prk, sizeof(prk));
+    OPENSSL_cleanse(block, sizeof(block));
+}
+
+// Both public keys and both ISNs go into the HKDF info, so the keys are
+// bound to this handshake
+int aead_derive(struct aead_keys *k, const uint8_t *priv, const uint8_t *peer_pub, const uint8_t *client_pub,
+                const uint8_t *server_pub, uint32_t client_isn, uint32_t server_isn, const uint8_t *psk,
+                size_t psk_len) {
+    uint8_t shared[AEAD_SHARE_LEN];
+    if (x25519(priv, peer_pub, shared) < 0) return -1;
+
+    uint8_t info[9 + 2 * AEAD_SHARE_LEN + 8];
+    uint32_t v;
+    memcpy(info, "sham keys", 9);
+    memcpy(info + 9, client_pub, AEAD_SHARE_LEN);
+    memcpy(info + 9 + AEAD_SHARE_LEN, server_pub, AEAD_SHARE_LEN);
+    v = htonl(client_isn);
+    memcpy(info + 9 + 2 * AEAD_SHARE_LEN, &v, 4);
+    v = htonl(server_isn);
+    memcpy(info + 13 + 2 * AEAD_SHARE_LEN, &v, 4);
+
+    static const uint8_t no_psk[32];
+    if (!psk || psk_len == 0) {
+        psk = no_psk;
+        psk_len = sizeof(no_psk);
+    }
+    hkdf(psk, psk_len, shared, sizeof(shared), info, sizeof(info), (uint8_t *)k, sizeof(*k));
+    OPENSSL_cleanse(shared, sizeof(shared));
+    return 0;
+}
+
+void aead_confirm(const uint8_t *confirm_key, const void *msg, size_t len, uint8_t out[AEAD_CONFIRM_LEN]) {
+    uint8_t digest[32];
+    unsigned int n = sizeof(digest);
+    HMAC(EVP_sha256(), confirm_key, 32, msg, len, digest, &n);
+    memcpy(out, digest, AEAD_CONFIRM_LEN);
+}
+
+// --- Packet protection ---
+
+static int dir_init(struct aead_dir *d, const uint8_t *key, const uint8_t *iv, int enc) {
+    d->ctx = EVP_CIPHER_CTX_new();
+    if (!d->ctx) return -1;
+    memcpy(d->iv, iv, AEAD_IV_LEN);
+    d->pn = 0;
+    d->seen = 0;
+    return EVP_CipherInit_ex(d->ctx, EVP_aes_128_gcm(), NULL, key, NULL, enc) == 1 ? 0 : -1;
+}
+
+struct aead *aead_new(const struct aead_keys *k, int server) {
+    struct aead *a = calloc(1, sizeof(*a));
+    if (!a) return NULL;
+    int out = server ? 1 : 0;
+    if (dir_init(&a->tx, k->key[out], k->iv[out], 1) < 0 || dir_init(&a->rx, k->key[!out], k->iv[!out], 0) < 0) {
+        aead_free(a);
+        return NULL;
+    }
+    memcpy(a->confirm, k->confirm, sizeof(a->confirm));
+    return a;
+}
+
+void aead_free(struct aead *a) {
+    if (!a) return;
+    EVP_CIPHER_CTX_free(a->tx.ctx);
+    EVP_CIPHER_CTX_free(a->rx.ctx);
+    OPENSSL_cleanse(a, sizeof(*a));
+    free(a);
+}
+
+static void nonce(const struct aead_dir *d, uint64_t pn, uint8_t out[AEAD_IV_LEN]) {
+    memcpy(out, d->iv, AEAD_IV_LEN);
+    for (int i = 0; i < 8; i++) out[AEAD_IV_LEN - 1 - i] ^= (uint8_t)(pn >> (8 * i));
+}
+
+static void put_pn(uint8_t *p, uint64_t pn) {
+    for (int i = 0; i < 8; i++) p[i] = (uint8_t)(pn >> (56 - 8 * i));
+}
+
+static uint64_t get_pn(const uint8_t *p) {
+    uint64_t pn = 0;
+    for (int i = 0; i < 8; i++) pn = pn << 8 | p[i];
+    return pn;
+}
+
+// Writes [ciphertext][share][pn][tag] to 'out' and returns its length
+size_t aead_seal(struct aead *a, const void *hdr, size_t hdr_len, const uint8_t *share, const uint8_t *in,
+                 size_t len, uint8_t *out) {
+    struct aead_dir *d = &a->tx;
+    uint64_t pn = ++d->pn;
+    uint8_t iv[AEAD_IV_LEN];
+    nonce(d, pn, iv);
+
+    uint8_t *trailer = out + len;
+    if (share) {
+        memcpy(trailer, share, AEAD_SHARE_LEN);
+        trailer += AEAD_SHARE_LEN;
+    }
+    put_pn(trailer, pn);
+
+    int n;
+    EVP_EncryptInit_ex(d->ctx, NULL, NULL, NULL, iv);
+    EVP_EncryptUpdate(d->ctx, NULL, &n, hdr, (int)hdr_len);
+    EVP_EncryptUpdate(d->ctx, NULL, &n, out + len, (int)(trailer + AEAD_PN_LEN - (out + len)));
+    if (len > 0) EVP_EncryptUpdate(d->ctx, out, &n, in, (int)len);
+    EVP_EncryptFinal_ex(d->ctx, out + len, &n);
+    EVP_CIPHER_CTX_ctrl(d->ctx, EVP_CTRL_GCM_GET_TAG, AEAD_TAG_LEN, trailer + AEAD_PN_LEN);
+    return trailer + AEAD_PN_LEN + AEAD_TAG_LEN - out;
+}
+
+// Decrypts in place. Fails on a bad tag or a packet number already seen
+// or older than the replay window.
+int aead_open(struct aead *a, const void *hdr, size_t hdr_len, int has_share, uint8_t *buf, size_t len,
+              size_t *plain_len) {
+    struct aead_dir *d = &a->rx;
+    size_t trailer_len = AEAD_OVERHEAD + (has_share ? AEAD_SHARE_LEN : 0);
+    if (len < trailer_len) return -1;
+    size_t ct_len = len - trailer_len;
+    uint8_t *pn_at = buf + len - AEAD_OVERHEAD;
+    uint64_t pn = get_pn(pn_at);
+
+    if (pn == 0) return -1;
+    if (pn <= d->pn) {
+        uint64_t back = d->pn - pn;
+        if (back >= AEAD_REPLAY_WINDOW || (d->seen >> back) & 1) return -1;
+    }
+
+    uint8_t iv[AEAD_IV_LEN];
+    nonce(d, pn, iv);
+    int n;
+    EVP_DecryptInit_ex(d->ctx, NULL, NULL, NULL, iv);
+    EVP_DecryptUpdate(d->ctx, NULL, &n, hdr, (int)hdr_len);
+    EVP_DecryptUpdate(d->ctx, NULL, &n, buf + ct_len, (int)(trailer_len - AEAD_TAG_LEN));
+    if (ct_len > 0) EVP_DecryptUpdate(d->ctx, buf, &n, buf, (int)ct_len);
+    EVP_CIPHER_CTX_ctrl(d->ctx, EVP_CTRL_GCM_SET_TAG, AEAD_TAG_LEN, pn_at + AEAD_PN_LEN);
+    if (EVP_DecryptFinal_ex(d->ctx, buf + ct_len, &n) != 1) return -1;
+
+    if (pn > d->pn) {
+        uint64_t shift = pn - d->pn;
+        d->seen = shift >= AEAD_REPLAY_WINDOW ? 1 : (d->seen << shift) | 1;
+        d->pn = pn;
+    } else {
+        d->seen |= 1ULL << (d->pn - pn);
+    }
+    *plain_len = ct_len;
+    return 0;
+}
+
+// The client key in a sealed packet with the KEY flag, before it is opened
+const uint8_t *aead_share(const uint8_t *buf, size_t len) {
+    if (len < AEAD_OVERHEAD + AEAD_SHARE_LEN) return NULL;
+    return buf + len - AEAD_OVERHEAD - AEAD_SHARE_LEN;
+}
+
+// --- Negotiation ---
+
+int aead_write_option(char *buf, const uint8_t *pub, const uint8_t *confirm) {
+    buf[0] = SHAM_OPT_KEY_SHARE;
+    buf[1] = AEAD_SHARE_LEN + (confirm ? AEAD_CONFIRM_LEN : 0);
+    memcpy(buf + 2, pub, AEAD_SHARE_LEN);
+    if (confirm) memcpy(buf + 2 + AEAD_SHARE_LEN, confirm, AEAD_CONFIRM_LEN);
+    return 2 + (uint8_t)buf[1];
+}
+
+// Returns the option's offset in 'buf', or -1 if there is none. 'confirm'
+// may be NULL when reading a SYN.
+int aead_read_option(const char *buf, int len, uint8_t *pub, uint8_t *confirm) {
+    int i = 0;
+    int want = AEAD_SHARE_LEN + (confirm ? AEAD_CONFIRM_LEN : 0);
+    while (i + 2 <= len) {
+        uint8_t kind = (uint8_t)buf[i];
+        uint8_t opt_len = (uint8_t)buf[i + 1];
+        if (i + 2 + opt_len > len) break;
+        if (kind == SHAM_OPT_KEY_SHARE && opt_len == want) {
+            memcpy(pub, buf + i + 2, AEAD_SHARE_LEN);
+            if (confirm) memcpy(confirm, buf + i + 2 + AEAD_SHARE_LEN, AEAD_CONFIRM_LEN);
+            return i;
+        }
+        i += 2 + opt_len;
+    }
+    return -1;
+}
@@ -0,0 +1,83 @@
+#ifndef AEAD_H
+#define AEAD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include <openssl/evp.h>
+
+// Authenticated encryption. The client offers an X25519 public key in its
+// SYN; the server answers with its own and a confirmation MAC, and both
+// sides derive AES-128-GCM keys with HKDF-SHA256 over the shared secret,
+// salted with an optional pre-shared key.
+//
+// The listener stays stateless: its key pair for a handshake is derived
+// from a random secret and the handshake's sequence numbers, and the
+// client repeats its public key on every packet (KEY flag) until it hears
+// back from the server, so whichever packet completes the handshake
+// carries what the server needs. The secret is replaced every cookie slot
+// and only kept in memory, so once a slot's secret is gone the session
+// keys of its handshakes cannot be recomputed (forward secrecy).
+//
+// Without a pre-shared key nothing authenticates the server: the exchange
+// keeps out eavesdroppers, but an active man in the middle can run its own
+// handshake with each side. Use a psk wherever that matters.
+//
+// Sealed packet: [header][ciphertext][client key if KEY][pn u64][tag]
+// The header, the client key and the packet number are authenticated.
+// Each direction numbers its packets from 1; the nonce is the direction's
+// IV XOR the packet number, so retransmissions never reuse one.
+#define AEAD_KEY_LEN 16
+#define AEAD_IV_LEN 12
+#define AEAD_TAG_LEN 16
+#define AEAD_PN_LEN 8
+#define AEAD_SHARE_LEN 32
+#define AEAD_CONFIRM_LEN 16
+#define AEAD_OVERHEAD (AEAD_PN_LEN + AEAD_TAG_LEN)
+#define AEAD_REPLAY_WINDOW 64
+
+// SYN option: [kind][len=32][client key]
+// SYN-ACK option: [kind][len=48][server key][confirm], where confirm is a
+// MAC over the options before it and the server key
+#define SHAM_OPT_KEY_SHARE 4
+
+// Traffic secrets; index 0 is client to server, 1 server to client
+struct aead_keys {
+    uint8_t key[2][AEAD_KEY_LEN];
+    uint8_t iv[2][AEAD_IV_LEN];
+    uint8_t confirm[32];
+};
+
+struct aead_dir {
+    EVP_CIPHER_CTX *ctx;         // Keyed once; only the nonce changes per packet
+    uint8_t iv[AEAD_IV_LEN];
+    uint64_t pn;                 // Send: last used. Receive: highest accepted
+    uint64_t seen;               // Receive: bitmap of the window below pn
+};
+
+struct aead {
+    struct aead_dir tx;
+    struct aead_dir rx;
+    uint8_t confirm[32];
+};
+
+int aead_keygen(uint8_t priv[AEAD_SHARE_LEN], uint8_t pub[AEAD_SHARE_LEN]);
+int aead_server_keypair(const uint8_t *secret, const struct sockaddr_in *peer, uint32_t client_isn,
+                        uint32_t server_isn, uint8_t priv[AEAD_SHARE_LEN], uint8_t pub[AEAD_SHARE_LEN]);
+int aead_derive(struct aead_keys *k, const uint8_t *priv, const uint8_t *peer_pub, const uint8_t *client_pub,
+                const uint8_t *server_pub, uint32_t client_isn, uint32_t server_isn, const uint8_t *psk,
+                size_t psk_len);
+void aead_confirm(const uint8_t *confirm_key, const void *msg, size_t len, uint8_t out[AEAD_CONFIRM_LEN]);
+
+struct aead *aead_new(const struct aead_keys *k, int server);
+void aead_free(struct aead *a);
+size_t aead_seal(struct aead *a, const void *hdr, size_t hdr_len, const uint8_t *share, const uint8_t *in,
+                 size_t len, uint8_t *out);
+int aead_open(struct aead *a, const void *hdr, size_t hdr_len, int has_share, uint8_t *buf, size_t len,
+              size_t *plain_len);
+const uint8_t *aead_share(const uint8_t *buf, size_t len);
+
+int aead_write_option(char *buf, const uint8_t *pub, const uint8_t *confirm);
+int aead_read_option(const char *buf, int len, uint8_t *pub, uint8_t *confirm);
+
+#endif // AEAD_H
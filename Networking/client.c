@@ -1,4 +1,8 @@
 #include "sham.h"
+#include "compress.h"
+#include "msg.h"
+#include "fec.h"
+#include <errno.h>
 #include <poll.h>
 
 void die(const char *s) {
@@ -6,17 +10,99 @@ void die(const char *s) {
     exit(1);
 }
 
+// Blocks until the whole buffer is queued on the connection
+static void send_all(struct sham_conn *conn, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = sham_send(conn, buf, len);
+        if (n < 0) {
+            if (errno != EAGAIN) die("sham_send");
+            sham_wait(conn, -1);
+            continue;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+// A resumption token is kept in a file between runs
+static void load_token(const char *path, struct sham_token *token) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return;
+    token->len = fread(token->data, 1, SHAM_TOKEN_MAX, f);
+    fclose(f);
+}
+
+// A pre-shared key is any file of up to SHAM_PSK_MAX bytes, the same on
+// both ends
+static size_t load_psk(const char *path, uint8_t *psk) {
+    FILE *f = fopen(path, "rb");
+    if (!f) die("psk file");
+    size_t n = fread(psk, 1, SHAM_PSK_MAX, f);
+    fclose(f);
+    if (n == 0) {
+        fprintf(stderr, "Empty psk file: %s\n", path);
+        exit(1);
+    }
+    return n;
+}
+
+static void save_token(const char *path, const struct sham_conn *conn) {
+    struct sham_token token;
+    if (sham_conn_token(conn, &token) < 0) return;
+    FILE *f = fopen(path, "wb");
+    if (!f) return;
+    fwrite(token.data, 1, token.len, f);
+    fclose(f);
+}
+
 int main(int argc, char *argv[]) {
+    // Pull out option flags so the positional arguments stay where they were
+    uint8_t offered_codecs = SHAM_CODEC_NONE;
+    uint8_t fec_mode = SHAM_FEC_OFF;
+    int fec_k = 0, fec_m = 0;
+    const char *resume_file = NULL;
+    const char *psk_file = NULL;
+    int encrypt = 0;
+    int argn = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--compress") == 0) {
+            offered_codecs = SHAM_CODECS_SUPPORTED;
+        } else if (strncmp(argv[i], "--fec=", 6) == 0) {
+            // --fec=xor[:k] or --fec=rs[:k[:m]]
+            const char *spec = argv[i] + 6;
+            if (strncmp(spec, "xor", 3) == 0) fec_mode = SHAM_FEC_XOR;
+            else if (strncmp(spec, "rs", 2) == 0) fec_mode = SHAM_FEC_RS;
+            else {
+                fprintf(stderr, "Unknown FEC mode: %s\n", spec);
+                exit(1);
+            }
+            const char *colon = strchr(spec, ':');
+            if (colon) sscanf(colon + 1, "%d:%d", &fec_k, &fec_m);
+        } else if (strncmp(argv[i], "--resume=", 9) == 0) {
+            resume_file = argv[i] + 9;
+        } else if (strcmp(argv[i], "--encrypt") == 0) {
+            encrypt = 1;
+        } else if (strncmp(argv[i], "--psk=", 6) == 0) {
+            psk_file = argv[i] + 6;
+            encrypt = 1;
+        } else {
+            argv[argn++] = argv[i];
+        }
+    }
+    argc = argn;
+
     if (argc < 4) {
         fprintf(stderr, "Usage:\n");
-        fprintf(stderr, "  File Transfer: %s <server_ip> <server_port> <input_file> <output_file_name> [loss_rate]\n", argv[0]);
-        fprintf(stderr, "  Chat Mode:     %s <server_ip> <server_port> --chat [loss_rate]\n", argv[0]);
+        fprintf(stderr, "  File Transfer: %s <server_ip> <server_port> <input_file> <output_file_name> [loss_rate] [--compress] [--fec=xor|rs[:k[:m]]] [--resume=<file>] [--encrypt] [--psk=<file>]\n", argv[0]);
+        fprintf(stderr, "  Download:      %s <server_ip> <server_port> --get <remote_file> <local_file> [loss_rate] [--compress] [--fec=xor|rs[:k[:m]]] [--resume=<file>] [--encrypt] [--psk=<file>]\n", argv[0]);
+        fprintf(stderr, "  Chat Mode:     %s <server_ip> <server_port> --chat [loss_rate] [--resume=<file>] [--encrypt] [--psk=<file>]\n", argv[0]);
         exit(1);
     }
 
     const char *server_ip = argv[1];
     int port = atoi(argv[2]);
     int chat_mode = 0;
+    int get_mode = 0;
     const char *input_file = NULL;
     const char *output_file_name = NULL;
     double loss_rate = 0.0;
@@ -24,6 +110,15 @@ int main(int argc, char *argv[]) {
     if (strcmp(argv[3], "--chat") == 0) {
         chat_mode = 1;
         if (argc > 4) loss_rate = atof(argv[4]);
+    } else if (strcmp(argv[3], "--get") == 0) {
+        if (argc < 6) {
+            fprintf(stderr, "Missing file arguments for download mode.\n");
+            exit(1);
+        }
+        get_mode = 1;
+        input_file = argv[4];       // Name on the server
+        output_file_name = argv[5]; // Local path
+        if (argc > 6) loss_rate = atof(argv[6]);
     } else {
         if (argc < 5) {
             fprintf(stderr, "Missing file arguments for file transfer mode.\n");
@@ -34,144 +129,217 @@ int main(int argc, char *argv[]) {
         if (argc > 5) loss_rate = atof(argv[5]);
     }
 
-    // **FIX:** Acknowledge that loss_rate is intentionally unused on the client.
-    (void)loss_rate; 
-
     init_logging("client_log.txt");
     srand(time(NULL));
 
-    int sockfd;
-    struct sockaddr_in server_addr;
-
-    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        die("socket creation failed");
+    struct sham_config cfg;
+    sham_config_init(&cfg);
+    cfg.codecs = chat_mode ? SHAM_CODEC_NONE : offered_codecs;
+    cfg.fec = fec_mode;
+    cfg.fec_k = fec_k;
+    cfg.fec_m = fec_m;
+    cfg.loss_rate = loss_rate;
+    cfg.encrypt = encrypt;
+    uint8_t psk[SHAM_PSK_MAX];
+    if (psk_file) {
+        cfg.psk = psk;
+        cfg.psk_len = load_psk(psk_file, psk);
     }
-
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    if (inet_aton(server_ip, &server_addr.sin_addr) == 0) {
-        fprintf(stderr, "inet_aton() failed\n");
-        exit(1);
-    }
-
-    // --- State Variables ---
-    uint32_t seq_num = rand() % 10000;
-    uint32_t ack_num = 0;
+    if (resume_file) load_token(resume_file, &cfg.token);
 
     // --- Handshake ---
-    struct sham_packet packet;
-    memset(&packet, 0, sizeof(packet));
-    packet.header.seq_num = htonl(seq_num);
-    packet.header.flags = htons(SYN);
-    sendto(sockfd, &packet, sizeof(packet.header), 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
-    log_event("SND SYN SEQ=%u\n", seq_num);
-    
-    recvfrom(sockfd, &packet, sizeof(packet), 0, NULL, NULL);
-    if ((ntohs(packet.header.flags) & (SYN | ACK)) && ntohl(packet.header.ack_num) == seq_num + 1) {
-        log_event("RCV SYN-ACK SEQ=%u ACK=%u\n", ntohl(packet.header.seq_num), ntohl(packet.header.ack_num));
-        ack_num = ntohl(packet.header.seq_num) + 1;
-        seq_num++;
-        
-        memset(&packet, 0, sizeof(packet));
-        packet.header.seq_num = htonl(seq_num);
-        packet.header.ack_num = htonl(ack_num);
-        packet.header.flags = htons(ACK);
-        sendto(sockfd, &packet, sizeof(packet.header), 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
-        log_event("SND ACK FOR SYN\n");
-        printf("Connection established.\n");
-    } else {
+    struct sham_conn *conn = sham_connect(server_ip, port, &cfg);
+    if (!conn) die("sham_connect");
+    // The upload's file name or the download request; with a token it goes
+    // out in the SYN itself (0-RTT)
+    char request[258];
+    size_t request_len = 0;
+    if (get_mode) request[request_len++] = FILE_REQ_GET;
+    if (!chat_mode) {
+        request_len += snprintf(request + request_len, sizeof(request) - request_len, "%s",
+                                get_mode ? input_file : output_file_name) + 1;
+        if (request_len > sizeof(request)) {
+            fprintf(stderr, "File name too long.\n");
+            exit(1);
+        }
+    }
+    int name_sent = 0;
+    if (!chat_mode && cfg.token.len > 0) {
+        send_all(conn, request, request_len);
+        name_sent = 1;
+    }
+    while (sham_conn_state(conn) == SHAM_CONNECTING) sham_wait(conn, -1);
+    if (sham_conn_state(conn) != SHAM_ESTABLISHED) {
         fprintf(stderr, "Handshake failed.\n");
         exit(1);
     }
-    
+    printf("Connection established.\n");
+    if (resume_file) save_token(resume_file, conn);
+    uint8_t codec = sham_conn_codec(conn);
+    if (codec != SHAM_CODEC_NONE) {
+        log_event("COMPRESS CODEC=%s\n", compress_codec_name(codec));
+        printf("Compression: %s\n", compress_codec_name(codec));
+    }
+    if (sham_conn_encrypted(conn)) {
+        // Only a psk proves who is at the other end
+        printf("Encryption: aes-128-gcm%s\n", psk_file ? "" : " (server not authenticated, no --psk)");
+    }
+    if (sham_conn_fec(conn) != SHAM_FEC_OFF) {
+        printf("FEC: %s\n", sham_conn_fec(conn) == SHAM_FEC_XOR ? "xor" : "reed-solomon");
+    }
+
     if (chat_mode) {
         // --- CHAT MODE ---
+        // Messages travel as length-prefixed records on the reliable stream
         printf("Entering Chat Mode. Type '/quit' to exit.\n");
         struct pollfd fds[2];
         fds[0].fd = STDIN_FILENO;
         fds[0].events = POLLIN;
-        fds[1].fd = sockfd;
+        fds[1].fd = sham_poll_fd(conn);
         fds[1].events = POLLIN;
 
         char buffer[PAYLOAD_SIZE];
+        int done = 0;
 
-        while(1) {
-            poll(fds, 2, -1);
+        while(!done) {
+            poll(fds, 2, sham_timeout(conn));
 
-            if (fds[0].revents & POLLIN) { // Keyboard input
-                fgets(buffer, PAYLOAD_SIZE, stdin);
+            if (fds[0].revents & (POLLIN | POLLHUP)) { // Keyboard input
+                if (fgets(buffer, PAYLOAD_SIZE, stdin) == NULL) strcpy(buffer, "/quit");
                 buffer[strcspn(buffer, "\n")] = 0;
-                
-                memset(&packet, 0, sizeof(packet));
-                strcpy(packet.data, buffer);
-                sendto(sockfd, &packet, sizeof(packet.header) + strlen(buffer) + 1, 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
-                
-                if (strcmp(buffer, "/quit") == 0) break;
+
+                if (sham_msg_send(conn, buffer, strlen(buffer)) < 0) {
+                    fprintf(stderr, "Send buffer full, message dropped.\n");
+                }
+                if (strcmp(buffer, "/quit") == 0) done = 1;
+            }
+            sham_process(conn);
+
+            int len;
+            while ((len = sham_msg_recv(conn, buffer, sizeof(buffer) - 1)) >= 0) {
+                buffer[len < (int)sizeof(buffer) ? len : (int)sizeof(buffer) - 1] = 0;
+                printf("Server: %s\n", buffer);
+                if (strcmp(buffer, "/quit") == 0) done = 1;
             }
-            if (fds[1].revents & POLLIN) { // Network input
-                recvfrom(sockfd, &packet, sizeof(packet), 0, NULL, NULL);
-                printf("Server: %s\n", packet.data);
-                if (strcmp(packet.data, "/quit") == 0) break;
+            if (errno == ENOTCONN) done = 1;
+            if (errno == EPROTO) {
+                fprintf(stderr, "Peer closed mid-message.\n");
+                done = 1;
             }
+
+            if (sham_conn_state(conn) == SHAM_FAILED) {
+                fprintf(stderr, "Connection lost.\n");
+                break;
+            }
+        }
+    } else if (get_mode) {
+        // --- DOWNLOAD MODE ---
+        if (!name_sent) send_all(conn, request, request_len);
+        FILE *fp = fopen(output_file_name, "wb");
+        if (!fp) die("fopen output file");
+
+        struct decompress_pipeline pipeline;
+        if (codec != SHAM_CODEC_NONE && decompress_pipeline_start(&pipeline, fp) < 0) {
+            die("decompress_pipeline_start");
+        }
+
+        // The reply starts with a status byte
+        char buffer[BUFFER_SIZE];
+        int have_status = 0;
+        while (1) {
+            ssize_t n = sham_recv(conn, buffer, sizeof(buffer));
+            if (n == 0) break;
+            if (n < 0) {
+                if (errno != EAGAIN) {
+                    fprintf(stderr, "Connection lost.\n");
+                    exit(1);
+                }
+                sham_wait(conn, -1);
+                continue;
+            }
+
+            char *data = buffer;
+            if (!have_status) {
+                if (*data != FILE_GET_OK) {
+                    fprintf(stderr, "Server cannot send %s.\n", input_file);
+                    exit(1);
+                }
+                have_status = 1;
+                data++;
+                n--;
+            }
+            if (codec != SHAM_CODEC_NONE) {
+                if (n > 0 && decompress_pipeline_write(&pipeline, data, n) < 0) {
+                    fprintf(stderr, "Corrupt compressed stream.\n");
+                    exit(1);
+                }
+            } else {
+                fwrite(data, 1, n, fp);
+            }
+        }
+        if (!have_status) {
+            fprintf(stderr, "Server closed the connection without a reply.\n");
+            exit(1);
         }
+        if (codec != SHAM_CODEC_NONE) {
+            if (decompress_pipeline_finish(&pipeline) < 0) {
+                fprintf(stderr, "Corrupt compressed stream.\n");
+                exit(1);
+            }
+            log_event("DECOMPRESS RAW=%llu WIRE=%llu\n",
+                      (unsigned long long)pipeline.raw_bytes, (unsigned long long)pipeline.wire_bytes);
+        }
+        fclose(fp);
     } else {
         // --- FILE TRANSFER MODE ---
         FILE *fp = fopen(input_file, "rb");
         if (!fp) die("fopen input file");
 
+        // With compression the file is read and compressed on its own
+        // thread; this loop only pulls ready-to-send stream bytes.
+        struct compress_pipeline pipeline;
+        if (codec != SHAM_CODEC_NONE && compress_pipeline_start(&pipeline, fp, codec) < 0) {
+            die("compress_pipeline_start");
+        }
+
         // Send filename first
-        memset(&packet, 0, sizeof(packet));
-        packet.header.seq_num = htonl(seq_num);
-        strcpy(packet.data, output_file_name);
-        sendto(sockfd, &packet, sizeof(packet.header) + strlen(output_file_name) + 1, 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
-        log_event("SND DATA SEQ=%u LEN=%zu\n", seq_num, strlen(output_file_name) + 1);
-        
-        recvfrom(sockfd, &packet, sizeof(packet), 0, NULL, NULL);
-        log_event("RCV ACK=%u\n", ntohl(packet.header.ack_num));
-        seq_num += strlen(output_file_name) + 1;
+        if (!name_sent) send_all(conn, request, request_len);
 
         // Send file contents
-        while(!feof(fp)) {
-            memset(&packet, 0, sizeof(packet));
-            int bytes_read = fread(packet.data, 1, PAYLOAD_SIZE, fp);
-            if (bytes_read <= 0) break;
-
-            packet.header.seq_num = htonl(seq_num);
-            
-            int sent = 0;
-            while(!sent) {
-                sendto(sockfd, &packet, sizeof(packet.header) + bytes_read, 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
-                log_event("SND DATA SEQ=%u LEN=%d\n", seq_num, bytes_read);
-
-                struct timeval tv;
-                tv.tv_sec = 0;
-                tv.tv_usec = RTO_MS * 1000;
-                setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
-                
-                int n = recvfrom(sockfd, &packet, sizeof(packet), 0, NULL, NULL);
-                if (n > 0 && (ntohs(packet.header.flags) & ACK) && ntohl(packet.header.ack_num) >= seq_num + bytes_read) {
-                    log_event("RCV ACK=%u\n", ntohl(packet.header.ack_num));
-                    sent = 1;
-                } else {
-                    log_event("TIMEOUT SEQ=%u\n", seq_num);
-                    log_event("RETX DATA SEQ=%u LEN=%d\n", seq_num, bytes_read);
-                }
+        char buffer[PAYLOAD_SIZE];
+        while(1) {
+            int bytes_read;
+            if (codec != SHAM_CODEC_NONE) {
+                bytes_read = compress_pipeline_read(&pipeline, buffer, sizeof(buffer));
+            } else {
+                bytes_read = fread(buffer, 1, sizeof(buffer), fp);
             }
-            seq_num += bytes_read;
+            if (bytes_read <= 0) break;
+            send_all(conn, buffer, bytes_read);
+        }
+        if (codec != SHAM_CODEC_NONE) {
+            if (compress_pipeline_finish(&pipeline) < 0) die("compress input file");
+            log_event("COMPRESS RAW=%llu WIRE=%llu RAW_BLOCKS=%llu\n",
+                      (unsigned long long)pipeline.raw_bytes, (unsigned long long)pipeline.wire_bytes,
+                      (unsigned long long)pipeline.raw_blocks);
         }
         fclose(fp);
-        
-        // Send FIN
-        memset(&packet, 0, sizeof(packet));
-        packet.header.seq_num = htonl(seq_num);
-        packet.header.flags = htons(FIN);
-        sendto(sockfd, &packet, sizeof(packet.header), 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
-        log_event("SND FIN SEQ=%u\n", seq_num);
-        printf("File transfer complete.\n");
     }
 
-    close(sockfd);
+    // --- Teardown ---
+    // FIN goes out once everything queued is acknowledged
+    sham_shutdown(conn);
+    while (sham_conn_state(conn) == SHAM_CLOSING) sham_wait(conn, -1);
+    if (!chat_mode) {
+        if (sham_conn_state(conn) == SHAM_CLOSED) printf("File transfer complete.\n");
+        else fprintf(stderr, "Connection lost before the transfer completed.\n");
+    }
+
+    struct sham_stats stats;
+    sham_conn_stats(conn, &stats);
+    log_event("MEM PEAK=%zu LIMIT=%zu SENT=%llu RETX=%llu\n", stats.mem_peak, stats.mem_limit,
+              (unsigned long long)stats.segments_sent, (unsigned long long)stats.retransmits);
+    sham_close(conn);
     close_logging();
     return 0;
 }// // #include "sham.h"
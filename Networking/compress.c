@@ -0,0 +1,346 @@
+#include "compress.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+// --- Byte ring ---
+
+static int ring_init(struct byte_ring *r, size_t size) {
+    r->buf = malloc(size);
+    if (!r->buf) return -1;
+    r->size = size;
+    r->head = 0;
+    r->count = 0;
+    r->closed = 0;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    return 0;
+}
+
+static void ring_destroy(struct byte_ring *r) {
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+    free(r->buf);
+    r->buf = NULL;
+}
+
+static void ring_close(struct byte_ring *r) {
+    pthread_mutex_lock(&r->lock);
+    r->closed = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// Blocks until all of 'data' is queued. Returns -1 if the ring was closed.
+static int ring_write(struct byte_ring *r, const char *data, size_t len) {
+    pthread_mutex_lock(&r->lock);
+    while (len > 0) {
+        while (r->count == r->size && !r->closed) {
+            pthread_cond_wait(&r->cond, &r->lock);
+        }
+        if (r->closed) {
+            pthread_mutex_unlock(&r->lock);
+            return -1;
+        }
+        size_t tail = (r->head + r->count) % r->size;
+        size_t chunk = r->size - r->count;
+        if (chunk > r->size - tail) chunk = r->size - tail;
+        if (chunk > len) chunk = len;
+        memcpy(r->buf + tail, data, chunk);
+        r->count += chunk;
+        data += chunk;
+        len -= chunk;
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return 0;
+}
+
+// Queues as much of 'data' as fits without waiting. Returns the bytes
+// queued, or -1 if the ring was closed.
+static ssize_t ring_try_write(struct byte_ring *r, const char *data, size_t len) {
+    pthread_mutex_lock(&r->lock);
+    if (r->closed) {
+        pthread_mutex_unlock(&r->lock);
+        return -1;
+    }
+    size_t total = 0;
+    while (total < len && r->count < r->size) {
+        size_t tail = (r->head + r->count) % r->size;
+        size_t chunk = r->size - r->count;
+        if (chunk > r->size - tail) chunk = r->size - tail;
+        if (chunk > len - total) chunk = len - total;
+        memcpy(r->buf + tail, data + total, chunk);
+        r->count += chunk;
+        total += chunk;
+    }
+    if (total > 0) pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    return total;
+}
+
+// Blocks until at least one byte is available. Returns 0 once the ring is
+// closed and drained.
+static size_t ring_read(struct byte_ring *r, char *buf, size_t max) {
+    pthread_mutex_lock(&r->lock);
+    while (r->count == 0 && !r->closed) {
+        pthread_cond_wait(&r->cond, &r->lock);
+    }
+    size_t total = 0;
+    while (total < max && r->count > 0) {
+        size_t chunk = r->size - r->head;
+        if (chunk > r->count) chunk = r->count;
+        if (chunk > max - total) chunk = max - total;
+        memcpy(buf + total, r->buf + r->head, chunk);
+        r->head = (r->head + chunk) % r->size;
+        r->count -= chunk;
+        total += chunk;
+    }
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    return total;
+}
+
+// Nonzero when ring_read would not block
+static int ring_readable(struct byte_ring *r) {
+    pthread_mutex_lock(&r->lock);
+    int ready = r->count > 0 || r->closed;
+    pthread_mutex_unlock(&r->lock);
+    return ready;
+}
+
+// Returns 0 when 'len' bytes were read, 1 on a clean end of stream and -1
+// if the stream ended part-way through.
+static int ring_read_full(struct byte_ring *r, char *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        size_t n = ring_read(r, buf + got, len - got);
+        if (n == 0) return got == 0 ? 1 : -1;
+        got += n;
+    }
+    return 0;
+}
+
+// --- Negotiation ---
+
+int compress_write_option(char *buf, uint8_t codecs) {
+    buf[0] = SHAM_OPT_COMPRESS;
+    buf[1] = 1;
+    buf[2] = (char)codecs;
+    return 3;
+}
+
+uint8_t compress_read_option(const char *buf, int len) {
+    int i = 0;
+    while (i + 2 <= len) {
+        uint8_t kind = (uint8_t)buf[i];
+        uint8_t opt_len = (uint8_t)buf[i + 1];
+        if (i + 2 + opt_len > len) break;
+        if (kind == SHAM_OPT_COMPRESS && opt_len >= 1) {
+            return (uint8_t)buf[i + 2];
+        }
+        i += 2 + opt_len;
+    }
+    return SHAM_CODEC_NONE;
+}
+
+uint8_t compress_choose_codec(uint8_t offered) {
+    if (offered & SHAM_CODECS_SUPPORTED & SHAM_CODEC_DEFLATE) return SHAM_CODEC_DEFLATE;
+    return SHAM_CODEC_NONE;
+}
+
+const char *compress_codec_name(uint8_t codec) {
+    switch (codec) {
+    case SHAM_CODEC_DEFLATE: return "deflate";
+    default: return "none";
+    }
+}
+
+// --- Sender pipeline ---
+
+static void put_frame_header(char *hdr, uint8_t codec, uint32_t raw_len, uint32_t wire_len) {
+    uint32_t v;
+    hdr[0] = (char)codec;
+    v = htonl(raw_len);
+    memcpy(hdr + 1, &v, 4);
+    v = htonl(wire_len);
+    memcpy(hdr + 5, &v, 4);
+}
+
+static void *compress_thread(void *arg) {
+    struct compress_pipeline *p = arg;
+    uLong bound = compressBound(COMPRESS_BLOCK_SIZE);
+    char *raw = malloc(COMPRESS_BLOCK_SIZE);
+    char *wire = malloc(bound);
+    char hdr[COMPRESS_FRAME_HDR];
+
+    if (!raw || !wire) {
+        p->error = 1;
+        goto out;
+    }
+
+    while (1) {
+        size_t raw_len = fread(raw, 1, COMPRESS_BLOCK_SIZE, p->in);
+        if (raw_len == 0) break;
+
+        uLongf wire_len = bound;
+        uint8_t codec = p->codec;
+        if (compress2((Bytef*)wire, &wire_len, (const Bytef*)raw, raw_len, Z_BEST_SPEED) != Z_OK ||
+            wire_len >= raw_len) {
+            // Block did not shrink: ship it as-is
+            codec = SHAM_CODEC_NONE;
+            wire_len = raw_len;
+            p->raw_blocks++;
+        }
+
+        put_frame_header(hdr, codec, raw_len, wire_len);
+        if (ring_write(&p->ring, hdr, sizeof(hdr)) < 0 ||
+            ring_write(&p->ring, codec == SHAM_CODEC_NONE ? raw : wire, wire_len) < 0) {
+            break;
+        }
+        p->raw_bytes += raw_len;
+        p->wire_bytes += wire_len + sizeof(hdr);
+    }
+    if (ferror(p->in)) p->error = 1;
+
+out:
+    free(raw);
+    free(wire);
+    ring_close(&p->ring);
+    return NULL;
+}
+
+int compress_pipeline_start(struct compress_pipeline *p, FILE *in, uint8_t codec) {
+    memset(p, 0, sizeof(*p));
+    p->in = in;
+    p->codec = codec;
+    if (ring_init(&p->ring, COMPRESS_RING_SIZE) < 0) return -1;
+    if (pthread_create(&p->thread, NULL, compress_thread, p) != 0) {
+        ring_destroy(&p->ring);
+        return -1;
+    }
+    return 0;
+}
+
+// Returns up to 'max' bytes of the framed stream, 0 at end of stream.
+int compress_pipeline_read(struct compress_pipeline *p, char *buf, int max) {
+    return (int)ring_read(&p->ring, buf, max);
+}
+
+// Like compress_pipeline_read, but fails with EAGAIN instead of waiting
+// for the codec thread
+int compress_pipeline_try_read(struct compress_pipeline *p, char *buf, int max) {
+    if (!ring_readable(&p->ring)) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return (int)ring_read(&p->ring, buf, max);
+}
+
+int compress_pipeline_finish(struct compress_pipeline *p) {
+    ring_close(&p->ring);
+    pthread_join(p->thread, NULL);
+    ring_destroy(&p->ring);
+    return p->error ? -1 : 0;
+}
+
+// --- Receiver pipeline ---
+
+static void *decompress_thread(void *arg) {
+    struct decompress_pipeline *p = arg;
+    uLong bound = compressBound(COMPRESS_BLOCK_SIZE);
+    char *raw = malloc(COMPRESS_BLOCK_SIZE);
+    char *wire = malloc(bound);
+    char hdr[COMPRESS_FRAME_HDR];
+
+    if (!raw || !wire) {
+        p->error = 1;
+        goto out;
+    }
+
+    int rc;
+    while ((rc = ring_read_full(&p->ring, hdr, sizeof(hdr))) == 0) {
+        uint8_t codec = (uint8_t)hdr[0];
+        uint32_t raw_len, wire_len;
+        memcpy(&raw_len, hdr + 1, 4);
+        memcpy(&wire_len, hdr + 5, 4);
+        raw_len = ntohl(raw_len);
+        wire_len = ntohl(wire_len);
+
+        if (raw_len > COMPRESS_BLOCK_SIZE || wire_len > bound ||
+            ring_read_full(&p->ring, wire, wire_len) != 0) {
+            p->error = 1;
+            break;
+        }
+
+        const char *block = wire;
+        if (codec == SHAM_CODEC_DEFLATE) {
+            uLongf out_len = raw_len;
+            if (uncompress((Bytef*)raw, &out_len, (const Bytef*)wire, wire_len) != Z_OK ||
+                out_len != raw_len) {
+                p->error = 1;
+                break;
+            }
+            block = raw;
+        } else if (codec != SHAM_CODEC_NONE || wire_len != raw_len) {
+            p->error = 1;
+            break;
+        }
+
+        if (fwrite(block, 1, raw_len, p->out) != raw_len) {
+            p->error = 1;
+            break;
+        }
+        p->raw_bytes += raw_len;
+        p->wire_bytes += wire_len + sizeof(hdr);
+    }
+    if (rc < 0) p->error = 1; // Truncated frame header
+
+out:
+    free(raw);
+    free(wire);
+    // Unblock the network loop if we bailed out early
+    ring_close(&p->ring);
+    return NULL;
+}
+
+int decompress_pipeline_start(struct decompress_pipeline *p, FILE *out) {
+    memset(p, 0, sizeof(*p));
+    p->out = out;
+    if (ring_init(&p->ring, COMPRESS_RING_SIZE) < 0) return -1;
+    if (pthread_create(&p->thread, NULL, decompress_thread, p) != 0) {
+        ring_destroy(&p->ring);
+        return -1;
+    }
+    return 0;
+}
+
+int decompress_pipeline_write(struct decompress_pipeline *p, const char *buf, int len) {
+    return ring_write(&p->ring, buf, len);
+}
+
+// Like decompress_pipeline_write, but queues only what fits and returns
+// its length instead of waiting for the codec thread. Fails with EAGAIN
+// when nothing fits and EPIPE once the thread has given up.
+int decompress_pipeline_try_write(struct decompress_pipeline *p, const char *buf, int len) {
+    ssize_t n = ring_try_write(&p->ring, buf, len);
+    if (n < 0) {
+        errno = EPIPE;
+        return -1;
+    }
+    if (n == 0 && len > 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return (int)n;
+}
+
+int decompress_pipeline_finish(struct decompress_pipeline *p) {
+    ring_close(&p->ring);
+    pthread_join(p->thread, NULL);
+    ring_destroy(&p->ring);
+    return p->error ? -1 : 0;
+}
@@ -0,0 +1,75 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Codec identifiers, offered by the client in the SYN as a bitmask and
+// echoed back by the server (single bit) in the SYN-ACK.
+#define SHAM_CODEC_NONE    0x00
+#define SHAM_CODEC_DEFLATE 0x01
+#define SHAM_CODECS_SUPPORTED SHAM_CODEC_DEFLATE
+
+// SYN / SYN-ACK option TLV: [kind][len][value...]
+#define SHAM_OPT_COMPRESS 1
+
+// Compressed stream framing. Every block of up to COMPRESS_BLOCK_SIZE
+// file bytes is sent as [codec u8][raw_len u32][wire_len u32] + wire_len
+// bytes. Blocks that do not shrink are sent with codec NONE.
+#define COMPRESS_BLOCK_SIZE (64 * 1024)
+#define COMPRESS_FRAME_HDR 9
+#define COMPRESS_RING_SIZE (4 * COMPRESS_BLOCK_SIZE)
+
+// Single-producer / single-consumer byte ring shared between the
+// network loop and a codec thread.
+struct byte_ring {
+    char *buf;
+    size_t size;
+    size_t head;   // Next byte to read
+    size_t count;  // Bytes currently buffered
+    int closed;    // Producer finished (or consumer gave up)
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+// Sender side: a thread reads the input file, compresses it block by
+// block and leaves the framed stream in 'ring' for the network loop.
+struct compress_pipeline {
+    FILE *in;
+    uint8_t codec;
+    struct byte_ring ring;
+    pthread_t thread;
+    int error;
+    uint64_t raw_bytes;
+    uint64_t wire_bytes;
+    uint64_t raw_blocks;   // Blocks that were left uncompressed
+};
+
+// Receiver side: the network loop pushes in-order stream bytes and a
+// thread parses frames, inflates them and writes the file.
+struct decompress_pipeline {
+    FILE *out;
+    struct byte_ring ring;
+    pthread_t thread;
+    int error;
+    uint64_t raw_bytes;
+    uint64_t wire_bytes;
+};
+
+int compress_write_option(char *buf, uint8_t codecs);
+uint8_t compress_read_option(const char *buf, int len);
+uint8_t compress_choose_codec(uint8_t offered);
+const char *compress_codec_name(uint8_t codec);
+
+int compress_pipeline_start(struct compress_pipeline *p, FILE *in, uint8_t codec);
+int compress_pipeline_read(struct compress_pipeline *p, char *buf, int max);
+int compress_pipeline_try_read(struct compress_pipeline *p, char *buf, int max);
+int compress_pipeline_finish(struct compress_pipeline *p);
+
+int decompress_pipeline_start(struct decompress_pipeline *p, FILE *out);
+int decompress_pipeline_write(struct decompress_pipeline *p, const char *buf, int len);
+int decompress_pipeline_try_write(struct decompress_pipeline *p, const char *buf, int len);
+int decompress_pipeline_finish(struct decompress_pipeline *p);
+
+#endif // COMPRESS_H
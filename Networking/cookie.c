@@ -0,0 +1,137 @@
+#include "cookie.h"
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+// HMAC-SHA256 over the peer's address followed by 'extra'
+static void mac(const uint8_t *key, const struct sockaddr_in *peer, int with_port, const void *extra,
+                size_t extra_len, uint8_t out[32]) {
+    uint8_t msg[32];
+    size_t n = 0;
+    memcpy(msg + n, &peer->sin_addr.s_addr, 4);
+    n += 4;
+    if (with_port) {
+        memcpy(msg + n, &peer->sin_port, 2);
+        n += 2;
+    }
+    memcpy(msg + n, extra, extra_len);
+    n += extra_len;
+
+    unsigned int out_len = 32;
+    HMAC(EVP_sha256(), key, COOKIE_KEY_LEN, msg, n, out, &out_len);
+}
+
+void cookie_init_key(uint8_t key[COOKIE_KEY_LEN]) {
+    if (RAND_bytes(key, COOKIE_KEY_LEN) != 1) {
+        // No entropy source: a weak key still keeps the handshake working
+        for (int i = 0; i < COOKIE_KEY_LEN; i++) key[i] = (uint8_t)rand();
+    }
+}
+
+static uint32_t cookie_hash(const uint8_t *key, const struct sockaddr_in *peer, uint32_t peer_isn, uint16_t opts,
+                            uint32_t slot) {
+    uint8_t extra[10], digest[32];
+    uint32_t v;
+    v = htonl(peer_isn);
+    memcpy(extra, &v, 4);
+    v = htonl(slot);
+    memcpy(extra + 4, &v, 4);
+    extra[8] = (uint8_t)(opts >> 8);
+    extra[9] = (uint8_t)opts;
+    mac(key, peer, 1, extra, sizeof(extra), digest);
+
+    memcpy(&v, digest, 4);
+    return ntohl(v) >> COOKIE_OPT_BITS;
+}
+
+uint32_t cookie_slot(uint32_t now) {
+    return now / COOKIE_SLOT_S;
+}
+
+uint32_t cookie_make(const uint8_t *key, const struct sockaddr_in *peer, uint32_t peer_isn, uint16_t opts,
+                     uint32_t now) {
+    opts &= (1 << COOKIE_OPT_BITS) - 1;
+    uint32_t slot = cookie_slot(now);
+    return (cookie_hash(key, peer, peer_isn, opts, slot) << COOKIE_OPT_BITS) | opts;
+}
+
+// Accepts cookies from the current and the previous time slot, and tells
+// which one the cookie was made in
+int cookie_check(const uint8_t *key, const struct sockaddr_in *peer, uint32_t peer_isn, uint32_t cookie,
+                 uint16_t *opts, uint32_t *slot, uint32_t now) {
+    uint16_t o = cookie & ((1 << COOKIE_OPT_BITS) - 1);
+    uint32_t cur = cookie_slot(now);
+    for (int back = 0; back < 2; back++) {
+        if (cookie_hash(key, peer, peer_isn, o, cur - back) == cookie >> COOKIE_OPT_BITS) {
+            *opts = o;
+            *slot = cur - back;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int token_write_option(char *buf, const uint8_t *key, const struct sockaddr_in *peer, uint32_t now) {
+    uint8_t body[8], digest[32];
+    uint32_t expiry = htonl(now + TOKEN_TTL_S);
+    uint32_t nonce;
+    if (RAND_bytes((uint8_t *)&nonce, 4) != 1) nonce = (uint32_t)rand();
+    memcpy(body, &expiry, 4);
+    memcpy(body + 4, &nonce, 4);
+    mac(key, peer, 0, body, sizeof(body), digest);
+
+    buf[0] = SHAM_OPT_TOKEN;
+    buf[1] = TOKEN_LEN;
+    memcpy(buf + 2, body, sizeof(body));
+    memcpy(buf + 2 + sizeof(body), digest, TOKEN_LEN - sizeof(body));
+    return 2 + TOKEN_LEN;
+}
+
+int token_read_option(const char *buf, int len, uint8_t *token) {
+    int i = 0;
+    while (i + 2 <= len) {
+        uint8_t kind = (uint8_t)buf[i];
+        uint8_t opt_len = (uint8_t)buf[i + 1];
+        if (i + 2 + opt_len > len) break;
+        if (kind == SHAM_OPT_TOKEN && opt_len == TOKEN_LEN) {
+            memcpy(token, buf + i + 2, TOKEN_LEN);
+            return 0;
+        }
+        i += 2 + opt_len;
+    }
+    return -1;
+}
+
+int token_check(const uint8_t *key, const struct sockaddr_in *peer, const uint8_t *token, uint32_t now) {
+    uint8_t digest[32];
+    uint32_t expiry;
+    memcpy(&expiry, token, 4);
+    if ((int32_t)(ntohl(expiry) - now) < 0) return -1;
+    mac(key, peer, 0, token, 8, digest);
+    return CRYPTO_memcmp(digest, token + 8, TOKEN_LEN - 8) == 0 ? 0 : -1;
+}
+
+// Records a checked token as taken. Returns -1 if it was taken before, or
+// if its set has no room left.
+int token_use(struct token_cache *cache, const uint8_t *token, uint32_t now) {
+    uint32_t expiry, nonce;
+    memcpy(&expiry, token, 4);
+    memcpy(&nonce, token + 4, 4);
+    expiry = ntohl(expiry);
+
+    struct token_used *set = cache->used[nonce % TOKEN_CACHE_SETS];
+    struct token_used *slot = NULL;
+    for (int i = 0; i < TOKEN_CACHE_WAYS; i++) {
+        int live = (int32_t)(set[i].expiry - now) >= 0;
+        if (live && set[i].expiry == expiry && set[i].nonce == nonce) return -1;
+        if (!live && !slot) slot = &set[i];
+    }
+    if (!slot) return -1;
+    slot->expiry = expiry;
+    slot->nonce = nonce;
+    return 0;
+}
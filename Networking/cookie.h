@@ -0,0 +1,57 @@
+#ifndef COOKIE_H
+#define COOKIE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+// Stateless handshake. The listener answers a SYN without creating any
+// state: its initial sequence number is a cookie, a keyed hash of the
+// client's address and ISN with the negotiated options packed into the
+// low bits. State is created only when an ACK echoes a valid cookie.
+//
+// ISN = [hash 21 bits][options 11 bits]; the hash also covers a time
+// slot, so a cookie stays valid for one to two COOKIE_SLOT_S periods.
+// 'now' is always wall-clock seconds from the endpoint's I/O backend.
+#define COOKIE_KEY_LEN 32
+#define COOKIE_OPT_BITS 11
+#define COOKIE_SLOT_S 64
+
+// Resumption token handed out in every SYN-ACK. A client that presents
+// it in a later SYN gets state straight away and may carry data in that
+// SYN (0-RTT). Tokens are bound to the client's IP address, not its
+// port, expire after TOKEN_TTL_S of wall-clock time (the key may be
+// persisted across restarts) and are good for one use: the listener
+// remembers the nonce of every token it has taken until it expires.
+//
+// Option TLV: [kind][len=20][expiry u32][nonce u32][mac 12 bytes]
+#define SHAM_OPT_TOKEN 3
+#define TOKEN_LEN 20
+#define TOKEN_TTL_S 600
+#define TOKEN_CACHE_SETS 4096
+#define TOKEN_CACHE_WAYS 4
+
+// Tokens taken and not yet expired. A token whose set is full is refused,
+// and its client falls back to the cookie handshake.
+struct token_used {
+    uint32_t expiry;
+    uint32_t nonce;
+};
+
+struct token_cache {
+    struct token_used used[TOKEN_CACHE_SETS][TOKEN_CACHE_WAYS];
+};
+
+void cookie_init_key(uint8_t key[COOKIE_KEY_LEN]);
+uint32_t cookie_make(const uint8_t *key, const struct sockaddr_in *peer, uint32_t peer_isn, uint16_t opts,
+                     uint32_t now);
+int cookie_check(const uint8_t *key, const struct sockaddr_in *peer, uint32_t peer_isn, uint32_t cookie,
+                 uint16_t *opts, uint32_t *slot, uint32_t now);
+uint32_t cookie_slot(uint32_t now);
+
+int token_write_option(char *buf, const uint8_t *key, const struct sockaddr_in *peer, uint32_t now);
+int token_read_option(const char *buf, int len, uint8_t *token);
+int token_check(const uint8_t *key, const struct sockaddr_in *peer, const uint8_t *token, uint32_t now);
+int token_use(struct token_cache *cache, const uint8_t *token, uint32_t now);
+
+#endif // COOKIE_H
@@ -0,0 +1,214 @@
+#include "fec.h"
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FEC_X86 1
+#endif
+
+// --- GF(2^8) arithmetic, polynomial x^8 + x^4 + x^3 + x^2 + 1 ---
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static uint8_t coef[FEC_MAX_M][FEC_MAX_K];
+static void (*mul_add_impl)(uint8_t *, const uint8_t *, uint8_t, size_t);
+static pthread_once_t fec_once = PTHREAD_ONCE_INIT;
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+    if (a == 0 || b == 0) return 0;
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static uint8_t gf_inv(uint8_t a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+static void xor_region(uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < len; i++) dst[i] ^= src[i];
+}
+
+static void mul_add_scalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    uint8_t row[256];
+    for (int x = 0; x < 256; x++) row[x] = gf_mul(c, (uint8_t)x);
+    for (size_t i = 0; i < len; i++) dst[i] ^= row[src[i]];
+}
+
+#ifdef FEC_X86
+// Split-table multiply: c*x = c*(x & 0x0f) ^ c*(x & 0xf0), each half
+// looked up 16 or 32 bytes at a time with a byte shuffle.
+static void nibble_tables(uint8_t c, uint8_t lo[16], uint8_t hi[16]) {
+    for (int x = 0; x < 16; x++) {
+        lo[x] = gf_mul(c, (uint8_t)x);
+        hi[x] = gf_mul(c, (uint8_t)(x << 4));
+    }
+}
+
+__attribute__((target("ssse3")))
+static void mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    uint8_t lo[16], hi[16];
+    nibble_tables(c, lo, hi);
+    __m128i tlo = _mm_loadu_si128((const __m128i *)lo);
+    __m128i thi = _mm_loadu_si128((const __m128i *)hi);
+    __m128i mask = _mm_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i l = _mm_shuffle_epi8(tlo, _mm_and_si128(x, mask));
+        __m128i h = _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(x, 4), mask));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+    }
+    for (; i < len; i++) dst[i] ^= lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+}
+
+__attribute__((target("avx2")))
+static void mul_add_avx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    uint8_t lo[16], hi[16];
+    nibble_tables(c, lo, hi);
+    __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+    __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i l = _mm256_shuffle_epi8(tlo, _mm256_and_si256(x, mask));
+        __m256i h = _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi64(x, 4), mask));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+    }
+    for (; i < len; i++) dst[i] ^= lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+}
+#endif
+
+static void fec_setup(void) {
+    int x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = (uint8_t)x;
+        gf_log[x] = (uint8_t)i;
+        x <<= 1;
+        if (x & 0x100) x ^= 0x11d;
+    }
+    for (int i = 255; i < 512; i++) gf_exp[i] = gf_exp[i - 255];
+
+    // Cauchy entries 1 / (x_j + y_i) with x_j = j and y_i = FEC_MAX_M + i,
+    // each column divided by its row-0 entry. Scaling columns keeps every
+    // square submatrix invertible, so the code stays MDS.
+    for (int j = 0; j < FEC_MAX_M; j++) {
+        for (int i = 0; i < FEC_MAX_K; i++) {
+            uint8_t cj = gf_inv((uint8_t)(j ^ (FEC_MAX_M + i)));
+            uint8_t c0 = gf_inv((uint8_t)(0 ^ (FEC_MAX_M + i)));
+            coef[j][i] = gf_mul(cj, gf_inv(c0));
+        }
+    }
+
+    mul_add_impl = mul_add_scalar;
+#ifdef FEC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) mul_add_impl = mul_add_avx2;
+    else if (__builtin_cpu_supports("ssse3")) mul_add_impl = mul_add_ssse3;
+#endif
+}
+
+void fec_init(void) {
+    pthread_once(&fec_once, fec_setup);
+}
+
+uint8_t fec_coef(int row, int col) {
+    return coef[row][col];
+}
+
+// dst ^= c * src over 'len' bytes
+void fec_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    if (c == 0) return;
+    if (c == 1) xor_region(dst, src, len);
+    else mul_add_impl(dst, src, c, len);
+}
+
+// Recovers r missing data columns from r parity rows. syndromes[p] holds
+// parity row rows[p] with every surviving data column already cancelled
+// out; out[e] receives data column cols[e]. Returns -1 if singular.
+int fec_solve(int r, const int *rows, const int *cols, uint8_t **syndromes, uint8_t **out, size_t len) {
+    uint8_t a[FEC_MAX_M][2 * FEC_MAX_M];
+
+    // Gauss-Jordan on [A | I] with A[p][e] = coef[rows[p]][cols[e]]
+    for (int p = 0; p < r; p++) {
+        for (int e = 0; e < r; e++) {
+            a[p][e] = coef[rows[p]][cols[e]];
+            a[p][r + e] = (p == e);
+        }
+    }
+    for (int col = 0; col < r; col++) {
+        int pivot = col;
+        while (pivot < r && a[pivot][col] == 0) pivot++;
+        if (pivot == r) return -1;
+        if (pivot != col) {
+            for (int j = 0; j < 2 * r; j++) {
+                uint8_t t = a[col][j];
+                a[col][j] = a[pivot][j];
+                a[pivot][j] = t;
+            }
+        }
+        uint8_t inv = gf_inv(a[col][col]);
+        for (int j = 0; j < 2 * r; j++) a[col][j] = gf_mul(a[col][j], inv);
+        for (int p = 0; p < r; p++) {
+            if (p == col || a[p][col] == 0) continue;
+            uint8_t f = a[p][col];
+            for (int j = 0; j < 2 * r; j++) a[p][j] ^= gf_mul(f, a[col][j]);
+        }
+    }
+
+    // d_e = sum_p A^-1[e][p] * s_p
+    for (int e = 0; e < r; e++) {
+        memset(out[e], 0, len);
+        for (int p = 0; p < r; p++) fec_mul_add(out[e], syndromes[p], a[e][r + p], len);
+    }
+    return 0;
+}
+
+// Parity segments for a group of k when the receiver reports a loss rate
+// of 'loss': the expected losses plus two standard deviations.
+int fec_parity_for(int k, double loss) {
+    double mean = k * loss;
+    int m = (int)ceil(mean + 2.0 * sqrt(mean * (1.0 - loss)));
+    if (m < 1) m = 1;
+    if (m > FEC_MAX_M) m = FEC_MAX_M;
+    return m;
+}
+
+int fec_write_option(char *buf, uint8_t mode, uint8_t k, uint8_t m) {
+    buf[0] = SHAM_OPT_FEC;
+    buf[1] = 3;
+    buf[2] = (char)mode;
+    buf[3] = (char)k;
+    buf[4] = (char)m;
+    return 5;
+}
+
+int fec_read_option(const char *buf, int len, uint8_t *mode, uint8_t *k, uint8_t *m) {
+    int i = 0;
+    while (i + 2 <= len) {
+        uint8_t kind = (uint8_t)buf[i];
+        uint8_t opt_len = (uint8_t)buf[i + 1];
+        if (i + 2 + opt_len > len) break;
+        if (kind == SHAM_OPT_FEC && opt_len >= 3) {
+            *mode = (uint8_t)buf[i + 2];
+            *k = (uint8_t)buf[i + 3];
+            *m = (uint8_t)buf[i + 4];
+            return 0;
+        }
+        i += 2 + opt_len;
+    }
+    return -1;
+}
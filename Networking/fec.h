@@ -0,0 +1,36 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Forward error correction over groups of up to FEC_MAX_K data segments.
+// Parity rows come from a Cauchy matrix scaled so that row 0 is all ones:
+// one parity segment is a plain XOR, more give a systematic Reed-Solomon
+// code that rebuilds as many lost segments as parity segments arrived.
+#define SHAM_FEC_OFF 0
+#define SHAM_FEC_XOR 1       // One parity segment per group
+#define SHAM_FEC_RS  2       // Up to FEC_MAX_M parity segments per group
+
+#define FEC_MAX_K 16
+#define FEC_MAX_M 4
+#define FEC_DEFAULT_K 8
+
+// SYN / SYN-ACK option TLV: [kind][len=3][mode][k][m], m = 0 is adaptive
+#define SHAM_OPT_FEC 2
+
+// Parity payload: [base_seq u32][k u8][m u8][index u8][pad u8]
+// [lens u16 x k] followed by the parity bytes
+#define FEC_HDR_FIXED 8
+#define FEC_HDR_MAX (FEC_HDR_FIXED + 2 * FEC_MAX_K)
+
+void fec_init(void);
+uint8_t fec_coef(int row, int col);
+void fec_mul_add(uint8_t *dst, const uint8_t *src, uint8_t coef, size_t len);
+int fec_solve(int r, const int *rows, const int *cols, uint8_t **syndromes, uint8_t **out, size_t len);
+int fec_parity_for(int k, double loss);
+
+int fec_write_option(char *buf, uint8_t mode, uint8_t k, uint8_t m);
+int fec_read_option(const char *buf, int len, uint8_t *mode, uint8_t *k, uint8_t *m);
+
+#endif // FEC_H
@@ -0,0 +1,39 @@
+#include "sham.h"
+
+FILE* log_file = NULL;
+
+void log_event(const char* format, ...) {
+    if (log_file == NULL) return;
+
+    char time_buffer[30];
+    struct timeval tv;
+    time_t curtime;
+
+    gettimeofday(&tv, NULL);
+    curtime = tv.tv_sec;
+
+    strftime(time_buffer, 30, "%Y-%m-%d %H:%M:%S", localtime(&curtime));
+    fprintf(log_file, "[%s.%06ld] [LOG] ", time_buffer, tv.tv_usec);
+
+    va_list args;
+    va_start(args, format);
+    vfprintf(log_file, format, args);
+    va_end(args);
+
+    fflush(log_file);
+}
+
+void init_logging(const char* filename) {
+    if (getenv("RUDP_LOG") != NULL && strcmp(getenv("RUDP_LOG"), "1") == 0) {
+        log_file = fopen(filename, "w");
+        if (log_file == NULL) {
+            perror("fopen log file");
+        }
+    }
+}
+
+void close_logging() {
+    if (log_file != NULL) {
+        fclose(log_file);
+    }
+}
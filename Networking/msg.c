@@ -0,0 +1,57 @@
+#include "msg.h"
+#include "sham_internal.h"
+#include <errno.h>
+
+// A frame larger than the receive buffer could never be read whole, and the
+// window would close on it for good.
+_Static_assert(MSG_HDR_LEN + MSG_MAX_LEN <= SHAM_RCVBUF, "message frame exceeds the receive buffer");
+
+// Queues one whole message. Returns -1 (errno EAGAIN) if the send buffer
+// cannot take all of it yet.
+int sham_msg_send(struct sham_conn *c, const char *buf, size_t len) {
+    if (len > MSG_MAX_LEN) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (sham_send_space(c) < MSG_HDR_LEN + len) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // Queued together, so a short message still leaves as one datagram
+    uint16_t prefix = htons((uint16_t)len);
+    struct iovec iov[2] = { { &prefix, MSG_HDR_LEN }, { (void *)buf, len } };
+    return sham_send_parts(c, iov, 2) < 0 ? -1 : 0;
+}
+
+// Returns the length of the next complete message (truncated to 'max'
+// bytes in 'buf'), or -1 with errno EAGAIN if no whole message has
+// arrived yet, ENOTCONN once the peer has finished sending, or EPROTO if
+// the peer finished in the middle of a message.
+int sham_msg_recv(struct sham_conn *c, char *buf, size_t max) {
+    uint8_t prefix[MSG_HDR_LEN];
+    ssize_t have = sham_peek(c, prefix, sizeof(prefix));
+    if (have == 0) errno = ENOTCONN;
+    if (have <= 0) return -1;
+
+    uint16_t len = 0;
+    if (have == MSG_HDR_LEN) {
+        memcpy(&len, prefix, MSG_HDR_LEN);
+        len = ntohs(len);
+    }
+    if (have < MSG_HDR_LEN || c->rcv_len < MSG_HDR_LEN + (size_t)len) {
+        // Nothing more comes after a FIN, so a partial frame never completes
+        errno = c->peer_fin ? EPROTO : EAGAIN;
+        return -1;
+    }
+
+    sham_recv(c, prefix, MSG_HDR_LEN);
+    size_t take = len < max ? len : max;
+    sham_recv(c, buf, take);
+    // Drop the part of the message that did not fit
+    for (size_t left = len - take; left > 0;) {
+        char skip[256];
+        left -= sham_recv(c, skip, left < sizeof(skip) ? left : sizeof(skip));
+    }
+    return len;
+}
@@ -0,0 +1,17 @@
+#ifndef MSG_H
+#define MSG_H
+
+#include "sham.h"
+
+// Reliable message mode on top of a S.H.A.M. connection. Messages are
+// framed as [len u16] + bytes on the sequenced, acknowledged stream, so
+// they arrive complete and in order. The connection coalesces small
+// messages queued while data is in flight into one datagram; a message
+// queued on an idle connection is sent at once.
+#define MSG_HDR_LEN 2
+#define MSG_MAX_LEN (BUFFER_SIZE - MSG_HDR_LEN) // A whole frame must fit the receive buffer
+
+int sham_msg_send(struct sham_conn *c, const char *buf, size_t len);
+int sham_msg_recv(struct sham_conn *c, char *buf, size_t max);
+
+#endif // MSG_H
@@ -0,0 +1,69 @@
+#include "pool.h"
+
+void pool_init(struct sham_pool *p) {
+    memset(p, 0, sizeof(*p));
+}
+
+void pool_destroy(struct sham_pool *p) {
+    for (size_t i = 0; i < p->nslabs; i++) free(p->slabs[i]);
+    free(p->slabs);
+    memset(p, 0, sizeof(*p));
+}
+
+static int pool_grow(struct sham_pool *p) {
+    void **slabs = realloc(p->slabs, (p->nslabs + 1) * sizeof(*slabs));
+    if (!slabs) return -1;
+    p->slabs = slabs;
+
+    struct sham_pbuf *slab = aligned_alloc(CACHE_LINE, POOL_SLAB_BUFS * sizeof(struct sham_pbuf));
+    if (!slab) return -1;
+    p->slabs[p->nslabs++] = slab;
+
+    for (int i = 0; i < POOL_SLAB_BUFS; i++) {
+        slab[i].pool = p;
+        slab[i].next = p->free;
+        p->free = &slab[i];
+    }
+    p->total += POOL_SLAB_BUFS;
+    return 0;
+}
+
+// Returns a buffer with one reference, charged to nobody. Contents are
+// not cleared; callers fill in what they send.
+struct sham_pbuf *pool_get(struct sham_pool *p) {
+    if (!p->free && pool_grow(p) < 0) return NULL;
+
+    struct sham_pbuf *pb = p->free;
+    p->free = pb->next;
+    pb->next = NULL;
+    pb->mem = NULL;
+    pb->refcnt = 1;
+    pb->len = 0;
+    p->in_use++;
+    return pb;
+}
+
+// Charges the buffer to a connection the first time the connection keeps
+// it. Fails if that would take the connection over its limit.
+int pbuf_charge(struct sham_pbuf *pb, struct sham_mem *mem) {
+    if (pb->mem) return 0;
+    if (mem->used + sizeof(*pb) > mem->limit) return -1;
+    mem->used += sizeof(*pb);
+    if (mem->used > mem->peak) mem->peak = mem->used;
+    pb->mem = mem;
+    return 0;
+}
+
+void pbuf_ref(struct sham_pbuf *pb) {
+    pb->refcnt++;
+}
+
+void pbuf_unref(struct sham_pbuf *pb) {
+    if (--pb->refcnt > 0) return;
+
+    if (pb->mem) pb->mem->used -= sizeof(*pb);
+    pb->mem = NULL;
+    pb->next = pb->pool->free;
+    pb->pool->free = pb;
+    pb->pool->in_use--;
+}
@@ -0,0 +1,49 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "sham.h"
+
+// Packet buffers. Each buffer holds one whole datagram and is carved from
+// cache-line-aligned slabs, so the data path never mallocs per packet.
+// Buffers are reference counted: a segment can sit in the retransmit
+// queue, an I/O batch and the FEC history at the same time, and goes
+// back to the free list when the last holder lets go.
+#define POOL_SLAB_BUFS 64
+#define CACHE_LINE 64
+
+// Memory charged to one connection
+struct sham_mem {
+    size_t used;
+    size_t peak;
+    size_t limit;
+};
+
+struct sham_pool;
+
+struct sham_pbuf {
+    struct sham_pbuf *next;      // Free list
+    struct sham_pool *pool;
+    struct sham_mem *mem;        // Connection charged for this buffer, if any
+    uint32_t refcnt;
+    uint16_t len;                // Datagram length, header included
+    struct sockaddr_in addr;     // Source of a received datagram
+    struct sham_packet pkt __attribute__((aligned(CACHE_LINE)));
+} __attribute__((aligned(CACHE_LINE)));
+
+struct sham_pool {
+    struct sham_pbuf *free;
+    void **slabs;
+    size_t nslabs;
+    size_t total;                // Buffers carved so far
+    size_t in_use;
+};
+
+void pool_init(struct sham_pool *p);
+void pool_destroy(struct sham_pool *p);
+struct sham_pbuf *pool_get(struct sham_pool *p);
+
+int pbuf_charge(struct sham_pbuf *pb, struct sham_mem *mem);
+void pbuf_ref(struct sham_pbuf *pb);
+void pbuf_unref(struct sham_pbuf *pb);
+
+#endif // POOL_H
@@ -1,5 +1,14 @@
 #include "sham.h"
+#include "compress.h"
+#include "msg.h"
+#include "fec.h"
+#ifdef SHAM_XDP
+#include "xdp.h"
+#endif
+#include <errno.h>
 #include <poll.h>
+#include <sys/stat.h>
+#include <openssl/rand.h>
 
 void die(const char *s) {
     perror(s);
@@ -34,9 +43,388 @@ void calculate_md5(const char* filename) {
 }
 
 
+// Loads the listener key, creating it on first use, so resumption tokens
+// stay valid across server restarts
+static int load_key(const char *path, uint8_t *key) {
+    FILE *f = fopen(path, "rb");
+    if (f) {
+        size_t n = fread(key, 1, SHAM_KEY_LEN, f);
+        fclose(f);
+        return n == SHAM_KEY_LEN ? 0 : -1;
+    }
+    if (RAND_bytes(key, SHAM_KEY_LEN) != 1) return -1;
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) return -1;
+    ssize_t n = write(fd, key, SHAM_KEY_LEN);
+    close(fd);
+    return n == SHAM_KEY_LEN ? 0 : -1;
+}
+
+// --- File sessions ---
+// Every transfer runs in one event loop; the library's send scheduler
+// shares the socket between the downloads in progress. Each accepted
+// connection carries one upload or one download (see FILE_REQ_GET).
+
+enum session_phase { SESSION_REQUEST, SESSION_UPLOAD, SESSION_DOWNLOAD, SESSION_CLOSING };
+
+struct session {
+    struct session *next;
+    struct sham_conn *conn;
+    enum session_phase phase;
+    int id;
+    uint8_t codec;
+    int get;                     // Download request
+    int started;                 // First byte of the request seen
+    int ok;
+    char name[256];
+    size_t name_len;
+    FILE *file;
+    char tmp_name[64];
+    struct decompress_pipeline dp;
+    struct compress_pipeline cp;
+    char in[PAYLOAD_SIZE];       // Upload bytes read but not written yet
+    int in_len;
+    int in_off;
+    char out[PAYLOAD_SIZE];      // Download bytes read but not queued yet
+    int out_len;
+    int out_off;
+    int eof;
+};
+
+// Downloads come from the --files directory only; without one every
+// request is refused
+static int files_dir = -1;
+
+// Files no client may read or replace: the listener key, the psk and the log
+#define PROTECTED_MAX 3
+static struct stat protected_files[PROTECTED_MAX];
+static int protected_count;
+
+static void protect_file(const char *path) {
+    if (path && protected_count < PROTECTED_MAX && stat(path, &protected_files[protected_count]) == 0) {
+        protected_count++;
+    }
+}
+
+static int is_protected(const struct stat *st) {
+    for (int i = 0; i < protected_count; i++) {
+        if (st->st_dev == protected_files[i].st_dev && st->st_ino == protected_files[i].st_ino) return 1;
+    }
+    return 0;
+}
+
+// A plain file name: no path, no hidden files
+static int valid_name(const char *name) {
+    return name[0] != '\0' && name[0] != '.' && strchr(name, '/') == NULL;
+}
+
+// Opens a regular file in the files directory, without following a link
+static FILE *download_open(const char *name) {
+    if (files_dir < 0 || !valid_name(name)) return NULL;
+    int fd = openat(files_dir, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+    if (fd < 0) return NULL;
+    struct stat st;
+    FILE *f = NULL;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && !is_protected(&st)) f = fdopen(fd, "rb");
+    if (!f) close(fd);
+    return f;
+}
+
+static int upload_start(struct session *s) {
+    struct stat st;
+    if (!valid_name(s->name) || (stat(s->name, &st) == 0 && is_protected(&st))) {
+        printf("Refusing to save upload as: %s\n", s->name);
+        return -1;
+    }
+    printf("Receiving file, will be saved as: %s\n", s->name);
+    snprintf(s->tmp_name, sizeof(s->tmp_name), "received_file.%d.tmp", s->id);
+    s->file = fopen(s->tmp_name, "wb");
+    if (!s->file) return -1;
+    // Inflating and writing happen on the pipeline thread
+    if (s->codec != SHAM_CODEC_NONE && decompress_pipeline_start(&s->dp, s->file) < 0) {
+        fclose(s->file);
+        s->file = NULL;
+        return -1;
+    }
+    s->phase = SESSION_UPLOAD;
+    return 0;
+}
+
+// Returns the bytes taken; fails with EAGAIN while the decompressor is full
+static int upload_write(struct session *s, const char *data, size_t n) {
+    if (s->codec != SHAM_CODEC_NONE) return decompress_pipeline_try_write(&s->dp, data, n);
+    return fwrite(data, 1, n, s->file) == n ? (int)n : -1;
+}
+
+static int upload_finish(struct session *s) {
+    int err = 0;
+    if (s->codec != SHAM_CODEC_NONE) {
+        err = decompress_pipeline_finish(&s->dp);
+        log_event("DECOMPRESS RAW=%llu WIRE=%llu\n",
+                  (unsigned long long)s->dp.raw_bytes, (unsigned long long)s->dp.wire_bytes);
+    }
+    fclose(s->file);
+    s->file = NULL;
+    if (err < 0) {
+        fprintf(stderr, "Corrupt compressed stream.\n");
+        return -1;
+    }
+    rename(s->tmp_name, s->name);
+    calculate_md5(s->name);
+    return 0;
+}
+
+static void download_start(struct session *s) {
+    uint8_t status = FILE_GET_NOT_FOUND;
+    s->file = download_open(s->name);
+    if (s->file && s->codec != SHAM_CODEC_NONE && compress_pipeline_start(&s->cp, s->file, s->codec) < 0) {
+        fclose(s->file);
+        s->file = NULL;
+    }
+    if (s->file) status = FILE_GET_OK;
+
+    // A fresh connection always has room for the status byte
+    sham_send(s->conn, &status, 1);
+    if (!s->file) {
+        printf("Requested file not available: %s\n", s->name);
+        sham_shutdown(s->conn);
+        s->phase = SESSION_CLOSING;
+        return;
+    }
+    printf("Sending file: %s\n", s->name);
+    s->phase = SESSION_DOWNLOAD;
+}
+
+// Queues file bytes while the connection has room. Sets *busy when the
+// compressor has not produced the next bytes yet.
+static int download_pump(struct session *s, int *busy) {
+    while (!s->eof || s->out_off < s->out_len) {
+        if (s->out_off == s->out_len) {
+            int n;
+            if (s->codec != SHAM_CODEC_NONE) {
+                n = compress_pipeline_try_read(&s->cp, s->out, sizeof(s->out));
+                if (n < 0) {
+                    *busy = 1;
+                    return 0;
+                }
+            } else {
+                n = fread(s->out, 1, sizeof(s->out), s->file);
+            }
+            if (n <= 0) {
+                s->eof = 1;
+                break;
+            }
+            s->out_len = n;
+            s->out_off = 0;
+        }
+        ssize_t n = sham_send(s->conn, s->out + s->out_off, s->out_len - s->out_off);
+        if (n < 0) return errno == EAGAIN ? 0 : -1;
+        s->out_off += n;
+    }
+
+    int err = 0;
+    if (s->codec != SHAM_CODEC_NONE) {
+        err = compress_pipeline_finish(&s->cp);
+        log_event("COMPRESS RAW=%llu WIRE=%llu RAW_BLOCKS=%llu\n",
+                  (unsigned long long)s->cp.raw_bytes, (unsigned long long)s->cp.wire_bytes,
+                  (unsigned long long)s->cp.raw_blocks);
+    }
+    fclose(s->file);
+    s->file = NULL;
+    if (err < 0) return -1;
+    sham_shutdown(s->conn);
+    s->phase = SESSION_CLOSING;
+    return 0;
+}
+
+// Reads the request, then the upload stream until the client's FIN. While
+// the decompressor is full it stops reading and sets *busy, so the unread
+// bytes close the receive window and the client backs off.
+static int session_input(struct session *s, int *busy) {
+    while (s->phase == SESSION_REQUEST || s->phase == SESSION_UPLOAD) {
+        if (s->in_off == s->in_len) {
+            ssize_t n = sham_recv(s->conn, s->in, sizeof(s->in));
+            if (n < 0) return errno == EAGAIN ? 0 : -1;
+            if (n == 0) {
+                if (s->phase == SESSION_REQUEST || upload_finish(s) < 0) return -1;
+                sham_shutdown(s->conn);
+                s->phase = SESSION_CLOSING;
+                return 0;
+            }
+            s->in_len = n;
+            s->in_off = 0;
+        }
+
+        while (s->phase == SESSION_REQUEST && s->in_off < s->in_len) {
+            char c = s->in[s->in_off++];
+            if (!s->started) {
+                s->started = 1;
+                s->get = c == FILE_REQ_GET;
+                if (s->get) continue;
+            }
+            if (c == '\0') {
+                if (s->get) download_start(s);
+                else if (upload_start(s) < 0) return -1;
+            } else if (s->name_len < sizeof(s->name) - 1) {
+                s->name[s->name_len++] = c;
+            }
+        }
+        if (s->phase == SESSION_UPLOAD && s->in_off < s->in_len) {
+            int n = upload_write(s, s->in + s->in_off, s->in_len - s->in_off);
+            if (n < 0 && errno == EAGAIN) {
+                *busy = 1;
+                return 0;
+            }
+            if (n < 0) {
+                fprintf(stderr, "Corrupt compressed stream.\n");
+                return -1;
+            }
+            s->in_off += n;
+        }
+    }
+    return 0;
+}
+
+// Advances a session; returns nonzero once it is over
+static int session_step(struct session *s, int *busy) {
+    if (sham_conn_state(s->conn) == SHAM_FAILED) return 1;
+    if (session_input(s, busy) < 0) return 1;
+    if (s->phase == SESSION_DOWNLOAD && download_pump(s, busy) < 0) return 1;
+    if (s->phase == SESSION_CLOSING && sham_conn_state(s->conn) != SHAM_CLOSING) {
+        s->ok = sham_conn_state(s->conn) == SHAM_CLOSED;
+        return 1;
+    }
+    return 0;
+}
+
+static void session_end(struct session *s) {
+    if (!s->ok) fprintf(stderr, "Connection lost.\n");
+    if (s->file) {
+        if (s->phase == SESSION_UPLOAD) {
+            if (s->codec != SHAM_CODEC_NONE) decompress_pipeline_finish(&s->dp);
+            fclose(s->file);
+            remove(s->tmp_name);
+        } else {
+            if (s->codec != SHAM_CODEC_NONE) compress_pipeline_finish(&s->cp);
+            fclose(s->file);
+        }
+    }
+
+    struct sham_stats stats;
+    sham_conn_stats(s->conn, &stats);
+    log_event("MEM PEAK=%zu LIMIT=%zu SENT=%llu RETX=%llu\n", stats.mem_peak, stats.mem_limit,
+              (unsigned long long)stats.segments_sent, (unsigned long long)stats.retransmits);
+    sham_close(s->conn);
+    free(s);
+}
+
+// Without 'serve' the server exits once its first transfer is over
+static int serve_files(struct sham_listener *listener, int serve) {
+    struct pollfd lfd = { .fd = sham_listener_fd(listener), .events = POLLIN };
+    struct session *sessions = NULL;
+    int next_id = 0, served = 0, failed = 0;
+    int busy = 0;
+
+    while (serve || served == 0 || sessions) {
+        int t = sham_listener_timeout(listener);
+        if (busy && (t < 0 || t > 1)) t = 1;
+        poll(&lfd, 1, t);
+        sham_listener_process(listener);
+
+        struct sham_conn *conn;
+        while ((conn = sham_accept(listener)) != NULL) {
+            struct session *s = calloc(1, sizeof(*s));
+            if (!s) die("calloc");
+            s->conn = conn;
+            s->id = next_id++;
+            s->codec = sham_conn_codec(conn);
+            const struct sockaddr_in *client_addr = sham_conn_peer(conn);
+            printf("Connection established with %s:%d\n", inet_ntoa(client_addr->sin_addr),
+                   ntohs(client_addr->sin_port));
+            if (s->codec != SHAM_CODEC_NONE) {
+                log_event("COMPRESS CODEC=%s\n", compress_codec_name(s->codec));
+            }
+            s->next = sessions;
+            sessions = s;
+        }
+
+        busy = 0;
+        struct session **pp = &sessions;
+        while (*pp) {
+            struct session *s = *pp;
+            if (session_step(s, &busy)) {
+                *pp = s->next;
+                if (!s->ok) failed = 1;
+                session_end(s);
+                served++;
+            } else {
+                pp = &s->next;
+            }
+        }
+    }
+    return failed ? -1 : 0;
+}
+
+// A pre-shared key is any file of up to SHAM_PSK_MAX bytes, the same on
+// both ends
+static size_t load_psk(const char *path, uint8_t *psk) {
+    FILE *f = fopen(path, "rb");
+    if (!f) die("psk file");
+    size_t n = fread(psk, 1, SHAM_PSK_MAX, f);
+    fclose(f);
+    if (n == 0) {
+        fprintf(stderr, "Empty psk file: %s\n", path);
+        exit(1);
+    }
+    return n;
+}
+
+#ifdef SHAM_XDP
+// --xdp=<ifname>[:<queue>]
+static struct sham_xdp *xdp_open(const char *spec, int skb) {
+    char ifname[IF_NAMESIZE] = "";
+    unsigned queue = 0;
+    sscanf(spec, "%15[^:]:%u", ifname, &queue);
+    struct sham_xdp *x = sham_xdp_new(ifname, queue, skb ? SHAM_XDP_SKB : 0);
+    if (!x) die("xdp");
+    return x;
+}
+
+static void xdp_close(struct sham_xdp *x) {
+    if (!x) return;
+    struct sham_xdp_stats stats;
+    sham_xdp_stats(x, &stats);
+    log_event("XDP RX=%llu/%llu TX=%llu/%llu (AF_XDP/UDP) BAD_CSUM=%llu\n", (unsigned long long)stats.rx_xsk,
+              (unsigned long long)stats.rx_udp, (unsigned long long)stats.tx_xsk, (unsigned long long)stats.tx_udp,
+              (unsigned long long)stats.rx_bad_csum);
+    sham_xdp_free(x);
+}
+#endif
+
 int main(int argc, char *argv[]) {
+    // Pull out option flags so the positional arguments stay where they were
+    const char *key_file = NULL;
+    const char *psk_file = NULL;
+    int serve = 0;
+    const char *files_path = NULL;
+    double rate_kb = 0;
+    const char *xdp_spec = NULL;
+    int xdp_skb = 0;
+    int argn = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--key=", 6) == 0) key_file = argv[i] + 6;
+        else if (strncmp(argv[i], "--psk=", 6) == 0) psk_file = argv[i] + 6;
+        else if (strcmp(argv[i], "--serve") == 0) serve = 1;
+        else if (strncmp(argv[i], "--files=", 8) == 0) files_path = argv[i] + 8;
+        else if (strncmp(argv[i], "--rate=", 7) == 0) rate_kb = atof(argv[i] + 7);
+        else if (strncmp(argv[i], "--xdp=", 6) == 0) xdp_spec = argv[i] + 6;
+        else if (strcmp(argv[i], "--xdp-skb") == 0) xdp_skb = 1;
+        else argv[argn++] = argv[i];
+    }
+    argc = argn;
+
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s <port> [--chat] [loss_rate]\n", argv[0]);
+        fprintf(stderr, "Usage: %s <port> [--chat] [loss_rate] [--key=<file>] [--psk=<file>] [--serve] [--files=<dir>] [--rate=<KB/s>] [--xdp=<ifname>[:<queue>]] [--xdp-skb]\n", argv[0]);
         exit(1);
     }
 
@@ -55,147 +443,131 @@ int main(int argc, char *argv[]) {
     
     init_logging("server_log.txt");
     srand(time(NULL)); // Seed for random loss simulation
-
-    int sockfd;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
-
-    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        die("socket creation failed");
+    protect_file("server_log.txt");
+    if (files_path && (files_dir = open(files_path, O_RDONLY | O_DIRECTORY)) < 0) die("files directory");
+
+    struct sham_config cfg;
+    sham_config_init(&cfg);
+    cfg.codecs = chat_mode ? SHAM_CODEC_NONE : SHAM_CODECS_SUPPORTED;
+    cfg.fec = SHAM_FEC_RS; // Accept whatever FEC mode the client asks for
+    cfg.loss_rate = loss_rate;
+    cfg.rate = (uint64_t)(rate_kb * 1000);
+    cfg.encrypt = 1; // Accept encryption; with a psk, require it
+    uint8_t psk[SHAM_PSK_MAX];
+    if (psk_file) {
+        cfg.psk = psk;
+        cfg.psk_len = load_psk(psk_file, psk);
+        protect_file(psk_file);
+    }
+    uint8_t key[SHAM_KEY_LEN];
+    if (key_file) {
+        if (load_key(key_file, key) < 0) die("key file");
+        cfg.key = key;
+        protect_file(key_file);
     }
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
-
-    if (bind(sockfd, (const struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        die("bind failed");
+#ifdef SHAM_XDP
+    struct sham_xdp *xdp = NULL;
+    if (xdp_spec) {
+        xdp = xdp_open(xdp_spec, xdp_skb);
+        cfg.io = sham_xdp_io(xdp);
     }
+#else
+    (void)xdp_skb;
+    if (xdp_spec) fprintf(stderr, "Built without AF_XDP support (make XDP=1), using UDP\n");
+#endif
+
+    struct sham_listener *listener = sham_listen(port, &cfg);
+    if (!listener) die("bind failed");
     
     printf("Server listening on port %d\n", port);
+#ifdef SHAM_XDP
+    if (xdp && sham_xdp_error(xdp)) printf("AF_XDP unavailable (%s), using UDP\n", sham_xdp_error(xdp));
+    else if (xdp) printf("AF_XDP datapath on %s\n", xdp_spec);
+#endif
 
-    // --- State Variables ---
-    uint32_t seq_num = rand();
-    uint32_t expected_seq_num = 0;
+    if (!chat_mode) {
+        // --- FILE TRANSFER MODE ---
+        int rc = serve_files(listener, serve);
+        sham_listener_close(listener);
+#ifdef SHAM_XDP
+        xdp_close(xdp);
+#endif
+        close_logging();
+        return rc < 0 ? 1 : 0;
+    }
 
     // --- Handshake ---
-    struct sham_packet packet;
-    recvfrom(sockfd, &packet, sizeof(packet), 0, (struct sockaddr*)&client_addr, &client_len);
-
-    if (ntohs(packet.header.flags) & SYN) {
-        log_event("RCV SYN SEQ=%u\n", ntohl(packet.header.seq_num));
-        expected_seq_num = ntohl(packet.header.seq_num) + 1;
-
-        struct sham_packet syn_ack_packet;
-        memset(&syn_ack_packet, 0, sizeof(syn_ack_packet));
-        syn_ack_packet.header.seq_num = htonl(seq_num);
-        syn_ack_packet.header.ack_num = htonl(expected_seq_num);
-        syn_ack_packet.header.flags = htons(SYN | ACK);
-        syn_ack_packet.header.window_size = htons(BUFFER_SIZE);
-        sendto(sockfd, &syn_ack_packet, sizeof(syn_ack_packet.header), 0, (struct sockaddr*)&client_addr, client_len);
-        log_event("SND SYN-ACK SEQ=%u ACK=%u\n", seq_num, expected_seq_num);
-
-        recvfrom(sockfd, &packet, sizeof(packet), 0, (struct sockaddr*)&client_addr, &client_len);
-        if ((ntohs(packet.header.flags) & ACK) && (ntohl(packet.header.ack_num) == seq_num + 1)) {
-            log_event("RCV ACK FOR SYN\n");
-            printf("Connection established with %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-        } else {
-            fprintf(stderr, "Handshake failed.\n");
-            exit(1);
-        }
-    } else {
-        fprintf(stderr, "Expected SYN packet, got something else.\n");
-        exit(1);
+    struct pollfd lfd = { .fd = sham_listener_fd(listener), .events = POLLIN };
+    struct sham_conn *conn;
+    while ((conn = sham_accept(listener)) == NULL) {
+        poll(&lfd, 1, sham_listener_timeout(listener));
+        sham_listener_process(listener);
+    }
+    const struct sockaddr_in *client_addr = sham_conn_peer(conn);
+    printf("Connection established with %s:%d\n", inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port));
+    uint8_t codec = sham_conn_codec(conn);
+    if (codec != SHAM_CODEC_NONE) {
+        log_event("COMPRESS CODEC=%s\n", compress_codec_name(codec));
     }
     
-    if (chat_mode) {
-        // --- CHAT MODE ---
-        printf("Entering Chat Mode. Type '/quit' to exit.\n");
-        struct pollfd fds[2];
-        fds[0].fd = STDIN_FILENO;
-        fds[0].events = POLLIN;
-        fds[1].fd = sockfd;
-        fds[1].events = POLLIN;
-
-        char buffer[PAYLOAD_SIZE];
-
-        while(1) {
-            poll(fds, 2, -1);
-
-            if (fds[0].revents & POLLIN) { // Keyboard input
-                fgets(buffer, PAYLOAD_SIZE, stdin);
-                buffer[strcspn(buffer, "\n")] = 0;
-
-                memset(&packet, 0, sizeof(packet));
-                strcpy(packet.data, buffer);
-                sendto(sockfd, &packet, sizeof(packet.header) + strlen(packet.data) + 1, 0, (struct sockaddr*)&client_addr, client_len);
-                
-                if (strcmp(buffer, "/quit") == 0) break;
-            }
-            if (fds[1].revents & POLLIN) { // Network input
-                // **FIX:** Removed the unused 'n' variable assignment.
-                recvfrom(sockfd, &packet, sizeof(packet), 0, (struct sockaddr*)&client_addr, &client_len);
-                printf("Client: %s\n", packet.data);
-                if (strcmp(packet.data, "/quit") == 0) break;
+    // --- CHAT MODE ---
+    // Messages travel as length-prefixed records on the reliable stream
+    printf("Entering Chat Mode. Type '/quit' to exit.\n");
+    struct pollfd fds[2];
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    fds[1].fd = sham_poll_fd(conn);
+    fds[1].events = POLLIN;
+
+    char buffer[PAYLOAD_SIZE];
+    int done = 0;
+
+    while(!done) {
+        poll(fds, 2, sham_timeout(conn));
+
+        if (fds[0].revents & (POLLIN | POLLHUP)) { // Keyboard input
+            if (fgets(buffer, PAYLOAD_SIZE, stdin) == NULL) strcpy(buffer, "/quit");
+            buffer[strcspn(buffer, "\n")] = 0;
+
+            if (sham_msg_send(conn, buffer, strlen(buffer)) < 0) {
+                fprintf(stderr, "Send buffer full, message dropped.\n");
             }
+            if (strcmp(buffer, "/quit") == 0) done = 1;
         }
-    } else {
-        // --- FILE TRANSFER MODE ---
-        FILE* output_file = fopen("received_file.tmp", "wb");
-        if (!output_file) die("fopen temp file");
-        char output_filename[256] = {0};
-
-        // First data packet is the filename
-        recvfrom(sockfd, &packet, sizeof(packet), 0, (struct sockaddr*)&client_addr, &client_len);
-        log_event("RCV DATA SEQ=%u LEN=%zu\n", ntohl(packet.header.seq_num), strlen(packet.data) + 1);
-        strcpy(output_filename, packet.data);
-        printf("Receiving file, will be saved as: %s\n", output_filename);
-        
-        expected_seq_num = ntohl(packet.header.seq_num) + strlen(packet.data) + 1;
-        
-        struct sham_packet ack_packet;
-        memset(&ack_packet, 0, sizeof(ack_packet));
-        ack_packet.header.flags = htons(ACK);
-        ack_packet.header.window_size = htons(BUFFER_SIZE);
-        ack_packet.header.ack_num = htonl(expected_seq_num);
-        sendto(sockfd, &ack_packet, sizeof(ack_packet.header), 0, (struct sockaddr*)&client_addr, client_len);
-        log_event("SND ACK=%u WIN=%u\n", expected_seq_num, BUFFER_SIZE);
-
-        while (1) {
-            int n = recvfrom(sockfd, &packet, sizeof(packet), 0, (struct sockaddr*)&client_addr, &client_len);
-            if (n <= 0) continue;
-
-            if (ntohs(packet.header.flags) & FIN) {
-                log_event("RCV FIN SEQ=%u\n", ntohl(packet.header.seq_num));
-                break;
-            }
+        sham_process(conn);
 
-            // Simulate packet loss
-            if ((double)rand() / RAND_MAX < loss_rate) {
-                log_event("DROP DATA SEQ=%u\n", ntohl(packet.header.seq_num));
-                continue;
-            }
-
-            log_event("RCV DATA SEQ=%u LEN=%d\n", ntohl(packet.header.seq_num), n - (int)sizeof(struct sham_header));
-            
-            if (ntohl(packet.header.seq_num) == expected_seq_num) {
-                int data_len = n - sizeof(struct sham_header);
-                fwrite(packet.data, 1, data_len, output_file);
-                expected_seq_num += data_len;
-            }
-            
-            ack_packet.header.ack_num = htonl(expected_seq_num);
-            sendto(sockfd, &ack_packet, sizeof(ack_packet.header), 0, (struct sockaddr*)&client_addr, client_len);
-            log_event("SND ACK=%u WIN=%u\n", expected_seq_num, BUFFER_SIZE);
+        int len;
+        while ((len = sham_msg_recv(conn, buffer, sizeof(buffer) - 1)) >= 0) {
+            buffer[len < (int)sizeof(buffer) ? len : (int)sizeof(buffer) - 1] = 0;
+            printf("Client: %s\n", buffer);
+            if (strcmp(buffer, "/quit") == 0) done = 1;
+        }
+        if (errno == ENOTCONN) done = 1;
+        if (errno == EPROTO) {
+            fprintf(stderr, "Peer closed mid-message.\n");
+            done = 1;
         }
-        fclose(output_file);
-        rename("received_file.tmp", output_filename);
 
-        calculate_md5(output_filename);
+        if (sham_conn_state(conn) == SHAM_FAILED) {
+            fprintf(stderr, "Connection lost.\n");
+            break;
+        }
     }
-    
-    close(sockfd);
+
+    // --- Teardown ---
+    sham_shutdown(conn);
+    while (sham_conn_state(conn) == SHAM_CLOSING) sham_wait(conn, -1);
+
+    struct sham_stats stats;
+    sham_conn_stats(conn, &stats);
+    log_event("MEM PEAK=%zu LIMIT=%zu SENT=%llu RETX=%llu\n", stats.mem_peak, stats.mem_limit,
+              (unsigned long long)stats.segments_sent, (unsigned long long)stats.retransmits);
+    sham_close(conn);
+    sham_listener_close(listener);
+#ifdef SHAM_XDP
+    xdp_close(xdp);
+#endif
     close_logging();
     return 0;
 }// #include "sham.h"
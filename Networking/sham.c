@@ -0,0 +1,1913 @@
+#define _GNU_SOURCE // sendmmsg, recvmmsg
+#include "sham_internal.h"
+#include "compress.h"
+#include <errno.h>
+#include <poll.h>
+#include <openssl/crypto.h>
+
+long long sham_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void sham_config_init(struct sham_config *cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+}
+
+// --- Segment queue helpers ---
+
+static struct sham_segment *sndq_at(const struct sham_conn *c, unsigned i) {
+    return &c->sndq[(c->sndq_head + i) % SHAM_SNDQ];
+}
+
+// Bytes the i-th queued segment may hold. A resuming client's first
+// segment rides in its SYN behind the options, so only it is kept shorter.
+static uint16_t seg_room(const struct sham_conn *c, unsigned i) {
+    const struct sham_config *cfg = &c->ep->cfg;
+    if (i == 0 && !c->syn_sent && cfg->token.len == TOKEN_LEN && !cfg->encrypt &&
+        c->mss > PAYLOAD_SIZE - SHAM_SYN_OPTS_MAX) {
+        return PAYLOAD_SIZE - SHAM_SYN_OPTS_MAX;
+    }
+    return c->mss;
+}
+
+static char *seg_data(const struct sham_segment *seg) {
+    return seg->pb->pkt.data;
+}
+
+static size_t rcv_free(const struct sham_conn *c) {
+    return SHAM_RCVBUF - c->rcv_len;
+}
+
+static uint16_t rcv_window(const struct sham_conn *c) {
+    return (uint16_t)rcv_free(c);
+}
+
+// --- Batched datagram I/O ---
+
+#ifndef __linux__
+// sendmmsg / recvmmsg are Linux-only; elsewhere move one datagram per call
+struct mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+
+static int sendmmsg(int fd, struct mmsghdr *msgs, unsigned int n, int flags) {
+    unsigned int i = 0;
+    for (; i < n; i++) {
+        ssize_t r = sendmsg(fd, &msgs[i].msg_hdr, flags);
+        if (r < 0) return i > 0 ? (int)i : -1;
+        msgs[i].msg_len = r;
+    }
+    return i;
+}
+
+static int recvmmsg(int fd, struct mmsghdr *msgs, unsigned int n, int flags, struct timespec *timeout) {
+    (void)timeout;
+    unsigned int i = 0;
+    for (; i < n; i++) {
+        ssize_t r = recvmsg(fd, &msgs[i].msg_hdr, flags);
+        if (r < 0) return i > 0 ? (int)i : -1;
+        msgs[i].msg_len = r;
+    }
+    return i;
+}
+#endif
+
+// The default backend: a UDP socket and the monotonic clock
+
+static long long udp_now(void *ctx) {
+    (void)ctx;
+    return sham_now_us();
+}
+
+static long long udp_wall(void *ctx) {
+    (void)ctx;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int udp_open(void *ctx, uint16_t port) {
+    (void)ctx;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0 || port == 0) return fd;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+static void udp_close(void *ctx, int fd) {
+    (void)ctx;
+    close(fd);
+}
+
+static void udp_msgs(struct mmsghdr *msgs, struct iovec *iov, struct sham_datagram *d, int n) {
+    for (int i = 0; i < n; i++) {
+        iov[i].iov_base = d[i].data;
+        iov[i].iov_len = d[i].len;
+        memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+        msgs[i].msg_hdr.msg_name = d[i].addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(*d[i].addr);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+static int udp_send(void *ctx, int fd, struct sham_datagram *d, int n) {
+    (void)ctx;
+    struct mmsghdr msgs[SHAM_BATCH];
+    struct iovec iov[SHAM_BATCH];
+    if (n > SHAM_BATCH) n = SHAM_BATCH;
+    udp_msgs(msgs, iov, d, n);
+    return sendmmsg(fd, msgs, n, 0);
+}
+
+static int udp_recv(void *ctx, int fd, struct sham_datagram *d, int n) {
+    (void)ctx;
+    struct mmsghdr msgs[SHAM_BATCH];
+    struct iovec iov[SHAM_BATCH];
+    if (n > SHAM_BATCH) n = SHAM_BATCH;
+    udp_msgs(msgs, iov, d, n);
+    int r = recvmmsg(fd, msgs, n, MSG_DONTWAIT, NULL);
+    for (int i = 0; i < r; i++) d[i].len = msgs[i].msg_len;
+    return r;
+}
+
+const struct sham_io sham_udp_io = {
+    .now_us = udp_now,
+    .wall_us = udp_wall,
+    .open = udp_open,
+    .close = udp_close,
+    .send = udp_send,
+    .recv = udp_recv,
+};
+
+static long long now_us(const struct sham_endpoint *ep) {
+    return ep->io->now_us(ep->io->ctx);
+}
+
+// Seconds on the backend's wall clock, for cookies and tokens
+static uint32_t wall_s(const struct sham_endpoint *ep) {
+    const struct sham_io *io = ep->io;
+    return (uint32_t)((io->wall_us ? io->wall_us(io->ctx) : io->now_us(io->ctx)) / 1000000);
+}
+
+// --- Output ---
+
+// Encrypts a queued datagram into 'out', leaving the buffer itself in the
+// clear for retransmission. Handshake packets are not sealed.
+static void seal_packet(struct sham_conn *c, const struct sham_pbuf *pb, struct sham_packet *out,
+                        struct sham_datagram *d) {
+    if (!c->aead || (ntohs(pb->pkt.header.flags) & SYN)) return;
+    const uint8_t *share = NULL;
+    out->header = pb->pkt.header;
+    if (!c->passive && !c->key_acked) {
+        out->header.flags = htons(ntohs(out->header.flags) | KEY);
+        share = c->kx_pub;
+    }
+    size_t len = aead_seal(c->aead, &out->header, sizeof(out->header), share, (const uint8_t *)pb->pkt.data,
+                           pb->len - sizeof(pb->pkt.header), (uint8_t *)out->data);
+    d->data = out;
+    d->len = sizeof(out->header) + len;
+}
+
+static void endpoint_flush(struct sham_endpoint *ep) {
+    struct sham_datagram d[SHAM_BATCH];
+
+    // Seal the whole batch before it goes out
+    for (int i = 0; i < ep->ntx; i++) {
+        d[i].data = &ep->tx[i]->pkt;
+        d[i].len = ep->tx[i]->len;
+        d[i].addr = &ep->tx_to[i];
+        if (ep->tx_conn[i]) seal_packet(ep->tx_conn[i], ep->tx[i], &ep->sealed[i], &d[i]);
+    }
+
+    int sent = 0;
+    while (sent < ep->ntx) {
+        int r = ep->io->send(ep->io->ctx, ep->fd, d + sent, ep->ntx - sent);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            r = 1; // Drop the datagram that failed, like a lost packet
+        }
+        sent += r;
+    }
+    for (int i = 0; i < ep->ntx; i++) pbuf_unref(ep->tx[i]);
+    ep->ntx = 0;
+}
+
+static void endpoint_queue(struct sham_endpoint *ep, struct sham_pbuf *pb, const struct sockaddr_in *to,
+                           struct sham_conn *c) {
+    if (ep->ntx == SHAM_BATCH) endpoint_flush(ep);
+    pbuf_ref(pb);
+    ep->tx[ep->ntx] = pb;
+    ep->tx_to[ep->ntx] = *to;
+    ep->tx_conn[ep->ntx] = c;
+    ep->ntx++;
+    if (ep->cfg.rate) ep->tokens -= pb->len;
+}
+
+// Fills in the header of a buffer whose payload is already in place and
+// queues it on the endpoint's batch.
+static void send_pbuf(struct sham_conn *c, struct sham_pbuf *pb, uint32_t seq, uint16_t flags, size_t len) {
+    struct sham_endpoint *ep = c->ep;
+    pb->pkt.header.seq_num = htonl(seq);
+    pb->pkt.header.ack_num = 0;
+    pb->pkt.header.flags = htons(flags);
+    c->rcv_adv = rcv_window(c);
+    pb->pkt.header.window_size = htons(c->rcv_adv);
+    if (flags & ACK) {
+        pb->pkt.header.ack_num = htonl(c->rcv_nxt);
+        c->ack_pending = 0;
+    }
+    pb->len = sizeof(pb->pkt.header) + len;
+    endpoint_queue(ep, pb, &c->peer, c);
+}
+
+static void send_packet(struct sham_conn *c, uint32_t seq, uint16_t flags, const char *data, size_t len) {
+    struct sham_pbuf *pb = pool_get(&c->ep->pool);
+    if (!pb) return;
+    if (len > 0) memcpy(pb->pkt.data, data, len);
+    send_pbuf(c, pb, seq, flags, len);
+    pbuf_unref(pb);
+}
+
+// The SYN carries what the client asks for; the SYN-ACK echoes what the
+// server accepted. A client holding a resumption token also sends its
+// first segment in the SYN, after an END marker.
+static void send_syn(struct sham_conn *c) {
+    const struct sham_config *cfg = &c->ep->cfg;
+    char payload[PAYLOAD_SIZE];
+    int len = 0;
+    if (cfg->codecs != SHAM_CODEC_NONE) len += compress_write_option(payload + len, cfg->codecs);
+    if (cfg->fec != SHAM_FEC_OFF) len += fec_write_option(payload + len, cfg->fec, cfg->fec_k, cfg->fec_m);
+    if (cfg->encrypt) len += aead_write_option(payload + len, c->kx_pub, NULL);
+    if (cfg->token.len == TOKEN_LEN) {
+        payload[len++] = SHAM_OPT_TOKEN;
+        payload[len++] = TOKEN_LEN;
+        memcpy(payload + len, cfg->token.data, TOKEN_LEN);
+        len += TOKEN_LEN;
+
+        // No 0-RTT data when encrypting: there are no keys yet
+        struct sham_segment *seg = c->sndq_count > 0 && !cfg->encrypt ? sndq_at(c, 0) : NULL;
+        if (seg && len + 1 + seg->len <= PAYLOAD_SIZE) {
+            payload[len++] = SHAM_OPT_END;
+            memcpy(payload + len, seg_data(seg), seg->len);
+            len += seg->len;
+            if (c->early_len == 0) {
+                c->early_len = seg->len;
+                c->sndq_sent = 1;
+                c->snd_nxt = seg->seq + seg->len;
+                c->segments_sent++;
+            }
+            seg->xmit_us = now_us(c->ep);
+        }
+    }
+    if (!c->syn_sent) c->syn_xmit_us = now_us(c->ep);
+    c->syn_sent = 1;
+    send_packet(c, c->iss, SYN, payload, len);
+    log_event("SND SYN SEQ=%u EARLY=%u\n", c->iss, c->early_len);
+}
+
+// Options of a SYN-ACK, with a fresh resumption token for the client. With
+// encryption the server's key share comes last, and its confirmation MAC
+// covers every option byte before it.
+static int syn_ack_options(const struct sham_endpoint *ep, const struct sockaddr_in *peer, char *buf,
+                           uint8_t codec, uint8_t fec_mode, uint8_t fec_k, uint8_t fec_m,
+                           const uint8_t *server_pub, const uint8_t *confirm_key) {
+    int len = 0;
+    if (codec != SHAM_CODEC_NONE) len += compress_write_option(buf + len, codec);
+    if (fec_mode != SHAM_FEC_OFF) len += fec_write_option(buf + len, fec_mode, fec_k, fec_m);
+    len += token_write_option(buf + len, ep->key, peer, wall_s(ep));
+    if (server_pub) {
+        uint8_t confirm[AEAD_CONFIRM_LEN] = {0};
+        int opt_len = aead_write_option(buf + len, server_pub, confirm);
+        aead_confirm(confirm_key, buf, len + 2 + AEAD_SHARE_LEN, confirm);
+        memcpy(buf + len + 2 + AEAD_SHARE_LEN, confirm, AEAD_CONFIRM_LEN);
+        len += opt_len;
+    }
+    return len;
+}
+
+static void send_syn_ack(struct sham_conn *c) {
+    char opts[SHAM_SYN_ACK_OPTS_MAX];
+    int opt_len = syn_ack_options(c->ep, &c->peer, opts, c->codec, c->fec_mode, c->fec_k, c->fec_m,
+                                  c->aead ? c->kx_pub : NULL, c->aead ? c->aead->confirm : NULL);
+    send_packet(c, c->iss, SYN | ACK, opts, opt_len);
+    log_event("SND SYN-ACK SEQ=%u ACK=%u\n", c->iss, c->rcv_nxt);
+}
+
+// Length of the option TLVs at the start of a SYN payload. Any 0-RTT data
+// starts at *data_off.
+static int syn_opts_len(const char *buf, int len, int *data_off) {
+    int i = 0;
+    while (i < len && buf[i] != SHAM_OPT_END) {
+        if (i + 2 > len || i + 2 + (uint8_t)buf[i + 1] > len) break;
+        i += 2 + (uint8_t)buf[i + 1];
+    }
+    *data_off = (i < len && buf[i] == SHAM_OPT_END) ? i + 1 : len;
+    return i;
+}
+
+// Writes SACK blocks for the segments held out of order, highest first,
+// merging neighbours. Returns the bytes written, 0 if nothing is held.
+static size_t sack_write(const struct sham_conn *c, char *buf) {
+    uint32_t start[SHAM_OOO_SLOTS], end[SHAM_OOO_SLOTS];
+    int n = 0;
+
+    // Insertion sort by sequence number, relative to rcv_nxt
+    for (int i = 0; i < SHAM_OOO_SLOTS; i++) {
+        const struct sham_segment *seg = &c->ooo[i];
+        if (!seg->pb) continue;
+        int j = n++;
+        while (j > 0 && (int32_t)(start[j - 1] - seg->seq) > 0) {
+            start[j] = start[j - 1];
+            end[j] = end[j - 1];
+            j--;
+        }
+        start[j] = seg->seq;
+        end[j] = seg->seq + seg->len;
+    }
+    if (n == 0) return 0;
+
+    int blocks = 0;
+    size_t len = 1;
+    for (int i = n - 1; i >= 0 && blocks < SHAM_SACK_MAX; ) {
+        uint32_t lo = start[i], hi = end[i];
+        while (--i >= 0 && (int32_t)(end[i] - lo) >= 0) {
+            if ((int32_t)(start[i] - lo) < 0) lo = start[i];
+            if ((int32_t)(end[i] - hi) > 0) hi = end[i];
+        }
+        uint32_t v = htonl(lo);
+        memcpy(buf + len, &v, 4);
+        v = htonl(hi);
+        memcpy(buf + len + 4, &v, 4);
+        len += 8;
+        blocks++;
+    }
+    buf[0] = (char)blocks;
+    return len;
+}
+
+static void send_ack(struct sham_conn *c) {
+    uint32_t seq = c->snd_nxt + (c->fin_sent ? 1 : 0);
+    char payload[4 + 1 + 8 * SHAM_SACK_MAX];
+    uint16_t flags = ACK;
+    size_t len = 0;
+
+    // Piggyback a pending FEC loss report
+    if (c->fec_rx && c->fec_rx->expected > 0) {
+        uint16_t report[2] = { htons(c->fec_rx->lost), htons(c->fec_rx->expected) };
+        c->fec_rx->lost = c->fec_rx->expected = 0;
+        memcpy(payload, report, sizeof(report));
+        len = sizeof(report);
+        flags |= LOSS;
+    }
+    size_t sack_len = sack_write(c, payload + len);
+    if (sack_len > 0) {
+        len += sack_len;
+        flags |= SACK;
+    }
+    send_packet(c, seq, flags, payload, len);
+    log_event("SND ACK=%u WIN=%u\n", c->rcv_nxt, rcv_window(c));
+}
+
+static void send_fin(struct sham_conn *c) {
+    send_packet(c, c->snd_end, FIN | ACK, NULL, 0);
+    log_event("SND FIN SEQ=%u\n", c->snd_end);
+}
+
+static void arm_rto(struct sham_conn *c, long long now) {
+    int outstanding = c->sndq_sent > 0 || (c->fin_sent && !c->fin_acked) || c->state == SHAM_CONNECTING;
+    c->rto_deadline = outstanding ? now + RTO_MS * 1000LL : 0;
+}
+
+// --- Forward error correction ---
+
+// Clamps requested FEC parameters to what this side supports
+static void fec_negotiate(uint8_t *mode, uint8_t *k, uint8_t *m) {
+    if (*mode != SHAM_FEC_XOR && *mode != SHAM_FEC_RS) {
+        *mode = SHAM_FEC_OFF;
+        *k = *m = 0;
+        return;
+    }
+    if (*k == 0 || *k > FEC_MAX_K) *k = FEC_DEFAULT_K;
+    if (*mode == SHAM_FEC_XOR) *m = 1;
+    else if (*m > FEC_MAX_M) *m = FEC_MAX_M;
+}
+
+static int fec_enable(struct sham_conn *c, uint8_t mode, uint8_t k, uint8_t m) {
+    fec_negotiate(&mode, &k, &m);
+    if (mode == SHAM_FEC_OFF) return 0;
+    c->fec_tx = calloc(1, sizeof(*c->fec_tx));
+    c->fec_rx = calloc(1, sizeof(*c->fec_rx));
+    if (!c->fec_tx || !c->fec_rx) {
+        free(c->fec_tx);
+        free(c->fec_rx);
+        c->fec_tx = NULL;
+        c->fec_rx = NULL;
+        return -1;
+    }
+    fec_init();
+    c->fec_mode = mode;
+    c->fec_k = k;
+    c->fec_m = m;
+    return 0;
+}
+
+// Payload bytes per data segment, leaving room for the FEC header and the
+// AEAD trailer (with the client's key share until the server has it)
+static uint16_t conn_mss(const struct sham_conn *c) {
+    size_t mss = PAYLOAD_SIZE;
+    if (c->fec_tx) mss -= FEC_HDR_MAX;
+    if (c->aead) mss -= AEAD_OVERHEAD + (c->passive || c->key_acked ? 0 : AEAD_SHARE_LEN);
+    return mss;
+}
+
+static void fec_send_group(struct sham_conn *c) {
+    struct sham_fec_tx *g = c->fec_tx;
+
+    for (int j = 0; j < g->m; j++) {
+        struct sham_pbuf *pb = pool_get(&c->ep->pool);
+        if (!pb) break;
+        char *payload = pb->pkt.data;
+        uint32_t base = htonl(g->base);
+        memcpy(payload, &base, 4);
+        payload[4] = (char)g->count;
+        payload[5] = (char)g->m;
+        payload[6] = (char)j;
+        payload[7] = 0;
+        for (int i = 0; i < g->count; i++) {
+            uint16_t len = htons(g->lens[i]);
+            memcpy(payload + FEC_HDR_FIXED + 2 * i, &len, 2);
+        }
+        size_t hdr = FEC_HDR_FIXED + 2 * g->count;
+        memcpy(payload + hdr, g->parity[j], g->max_len);
+        send_pbuf(c, pb, g->base, FEC | ACK, hdr + g->max_len);
+        pbuf_unref(pb);
+        log_event("SND FEC SEQ=%u K=%d IDX=%d\n", g->base, g->count, j);
+    }
+    g->count = 0;
+}
+
+// Folds a first transmission into the open parity group
+static void fec_add(struct sham_conn *c, const struct sham_segment *seg) {
+    struct sham_fec_tx *g = c->fec_tx;
+
+    if (g->count == 0) {
+        g->base = seg->seq;
+        g->m = c->fec_m ? c->fec_m : fec_parity_for(c->fec_k, c->fec_loss);
+        g->max_len = 0;
+        for (int j = 0; j < g->m; j++) memset(g->parity[j], 0, sizeof(g->parity[j]));
+    }
+    for (int j = 0; j < g->m; j++) {
+        fec_mul_add(g->parity[j], (const uint8_t*)seg_data(seg), fec_coef(j, g->count), seg->len);
+    }
+    g->lens[g->count++] = seg->len;
+    if (seg->len > g->max_len) g->max_len = seg->len;
+    if (g->count == c->fec_k) fec_send_group(c);
+}
+
+static const struct sham_segment *fec_history_find(const struct sham_fec_rx *rx, uint32_t seq, uint16_t len) {
+    for (int i = 0; i < FEC_HISTORY; i++) {
+        const struct sham_segment *seg = &rx->history[i];
+        if (seg->pb && seg->len == len && seg->seq == seq) return seg;
+    }
+    return NULL;
+}
+
+// Keeps a reference to the received buffer rather than a copy
+static void fec_history_add(struct sham_conn *c, uint32_t seq, struct sham_pbuf *pb, size_t len) {
+    struct sham_fec_rx *rx = c->fec_rx;
+    if (fec_history_find(rx, seq, len)) return;
+    struct sham_segment *seg = &rx->history[rx->history_next];
+    if (seg->pb) pbuf_unref(seg->pb);
+    seg->pb = NULL;
+    if (pbuf_charge(pb, &c->mem) < 0) return;
+    pbuf_ref(pb);
+    rx->history_next = (rx->history_next + 1) % FEC_HISTORY;
+    seg->seq = seq;
+    seg->len = len;
+    seg->pb = pb;
+}
+
+static void on_data(struct sham_conn *c, uint32_t seq, struct sham_pbuf *pb, size_t len);
+
+// Rebuilds the missing members of the group starting at 'base' once at
+// least as many parity segments as missing members have arrived.
+static void fec_try_decode(struct sham_conn *c, uint32_t base) {
+    struct sham_fec_rx *rx = c->fec_rx;
+    struct sham_fec_parity *parity[FEC_MAX_M];
+    int rows[FEC_MAX_M], cols[FEC_MAX_M];
+    int nparity = 0, nmissing = 0, needed = 0;
+    const struct sham_segment *have[FEC_MAX_K];
+    uint32_t seqs[FEC_MAX_K];
+
+    for (int i = 0; i < FEC_PARITY_SLOTS; i++) {
+        struct sham_fec_parity *p = &rx->parity[i];
+        if (p->pb && p->base == base && nparity < FEC_MAX_M) parity[nparity++] = p;
+    }
+    if (nparity == 0) return;
+
+    const struct sham_fec_parity *first = parity[0];
+    uint32_t seq = base;
+    for (int i = 0; i < first->k; i++) {
+        seqs[i] = seq;
+        have[i] = fec_history_find(rx, seq, first->lens[i]);
+        if (!have[i]) {
+            if (nmissing < FEC_MAX_M) cols[nmissing] = i;
+            nmissing++;
+            if ((int32_t)(seq + first->lens[i] - c->rcv_nxt) > 0) needed++;
+        }
+        seq += first->lens[i];
+    }
+
+    if (needed > 0 && nmissing <= nparity) {
+        uint8_t syn_buf[FEC_MAX_M][PAYLOAD_SIZE];
+        uint8_t *syn[FEC_MAX_M], *out[FEC_MAX_M];
+        struct sham_pbuf *rebuilt[FEC_MAX_M];
+
+        // Cancel the members we have out of each parity row. Lost members
+        // are rebuilt straight into pool buffers, as if they had arrived.
+        for (int p = 0; p < nmissing; p++) {
+            rebuilt[p] = pool_get(&c->ep->pool);
+            if (!rebuilt[p]) {
+                while (p-- > 0) pbuf_unref(rebuilt[p]);
+                return;
+            }
+            rows[p] = parity[p]->index;
+            syn[p] = syn_buf[p];
+            out[p] = (uint8_t*)rebuilt[p]->pkt.data;
+            memcpy(syn[p], parity[p]->pb->pkt.data + parity[p]->off, first->len);
+            for (int i = 0; i < first->k; i++) {
+                if (have[i]) fec_mul_add(syn[p], (const uint8_t*)seg_data(have[i]), fec_coef(rows[p], i), have[i]->len);
+            }
+        }
+        if (fec_solve(nmissing, rows, cols, syn, out, first->len) < 0) {
+            for (int e = 0; e < nmissing; e++) pbuf_unref(rebuilt[e]);
+            return;
+        }
+
+        for (int e = 0; e < nmissing; e++) {
+            int i = cols[e];
+            log_event("FEC RECOVER SEQ=%u LEN=%u\n", seqs[i], first->lens[i]);
+            c->fec_recovered++;
+            fec_history_add(c, seqs[i], rebuilt[e], first->lens[i]);
+            on_data(c, seqs[i], rebuilt[e], first->lens[i]);
+            pbuf_unref(rebuilt[e]);
+        }
+    } else if (needed > 0) {
+        return; // Wait for more parity or data
+    }
+
+    for (int p = 0; p < nparity; p++) {
+        pbuf_unref(parity[p]->pb);
+        parity[p]->pb = NULL;
+    }
+}
+
+static void fec_on_parity(struct sham_conn *c, uint32_t seq, struct sham_pbuf *pb, size_t len) {
+    struct sham_fec_rx *rx = c->fec_rx;
+    const char *payload = pb->pkt.data;
+    if (!rx || len < FEC_HDR_FIXED) return;
+
+    uint32_t base;
+    memcpy(&base, payload, 4);
+    base = ntohl(base);
+    uint8_t k = (uint8_t)payload[4];
+    uint8_t index = (uint8_t)payload[6];
+    size_t hdr = FEC_HDR_FIXED + 2 * (size_t)k;
+    if (base != seq || k == 0 || k > FEC_MAX_K || index >= FEC_MAX_M || len < hdr) return;
+    log_event("RCV FEC SEQ=%u K=%u IDX=%u\n", base, k, index);
+
+    struct sham_fec_parity *p = &rx->parity[rx->parity_next];
+    if (p->pb) pbuf_unref(p->pb);
+    p->pb = NULL;
+    p->base = base;
+    p->k = k;
+    p->index = index;
+    p->off = hdr;
+    p->len = len - hdr;
+    for (int i = 0; i < k; i++) {
+        uint16_t l;
+        memcpy(&l, payload + FEC_HDR_FIXED + 2 * i, 2);
+        p->lens[i] = ntohs(l);
+        if (p->lens[i] > p->len) return;
+    }
+    if (pbuf_charge(pb, &c->mem) < 0) return;
+    pbuf_ref(pb);
+    p->pb = pb;
+    rx->parity_next = (rx->parity_next + 1) % FEC_PARITY_SLOTS;
+
+    // The first parity of each group tells us how many members were lost
+    if (!rx->counted_any || rx->counted_base != base) {
+        uint32_t s = base;
+        for (int i = 0; i < k; i++) {
+            if (!fec_history_find(rx, s, p->lens[i]) && (int32_t)(s + p->lens[i] - c->rcv_nxt) > 0) rx->lost++;
+            s += p->lens[i];
+        }
+        rx->expected += k;
+        rx->counted_base = base;
+        rx->counted_any = 1;
+        c->ack_pending = 1;
+    }
+
+    fec_try_decode(c, base);
+}
+
+// Records a data segment and retries any parity group it belongs to
+static void fec_on_data(struct sham_conn *c, uint32_t seq, struct sham_pbuf *pb, size_t len) {
+    struct sham_fec_rx *rx = c->fec_rx;
+    fec_history_add(c, seq, pb, len);
+
+    for (int i = 0; i < FEC_PARITY_SLOTS; i++) {
+        struct sham_fec_parity *p = &rx->parity[i];
+        if (!p->pb || (int32_t)(seq - p->base) < 0) continue;
+        uint32_t end = p->base;
+        for (int j = 0; j < p->k; j++) end += p->lens[j];
+        if ((int32_t)(seq - end) < 0) fec_try_decode(c, p->base);
+    }
+}
+
+static void fec_on_report(struct sham_conn *c, const char *payload, size_t len) {
+    if (len < 4) return;
+    uint16_t lost, expected;
+    memcpy(&lost, payload, 2);
+    memcpy(&expected, payload + 2, 2);
+    lost = ntohs(lost);
+    expected = ntohs(expected);
+    if (expected == 0) return;
+    c->fec_loss = 0.75 * c->fec_loss + 0.25 * ((double)lost / expected);
+    log_event("RCV LOSS LOST=%u EXPECTED=%u\n", lost, expected);
+}
+
+// --- Loss detection (RACK / TLP) ---
+
+static void rtt_sample(struct sham_conn *c, long long rtt) {
+    if (rtt <= 0) rtt = 1;
+    if (c->srtt_us == 0) {
+        c->srtt_us = rtt;
+        c->rttvar_us = rtt / 2;
+    } else {
+        long long err = c->srtt_us > rtt ? c->srtt_us - rtt : rtt - c->srtt_us;
+        c->rttvar_us = (3 * c->rttvar_us + err) / 4;
+        c->srtt_us = (7 * c->srtt_us + rtt) / 8;
+    }
+    if (c->min_rtt_us == 0 || rtt < c->min_rtt_us) c->min_rtt_us = rtt;
+}
+
+// A segment reached the peer, by cumulative ACK or SACK
+static void rack_delivered(struct sham_conn *c, const struct sham_segment *seg, long long now) {
+    long long rtt = now - seg->xmit_us;
+    if (!seg->retx) rtt_sample(c, rtt);
+    // An ACK faster than any real round trip is for an earlier copy
+    else if (rtt < c->min_rtt_us) return;
+    if (seg->xmit_us > c->rack_xmit_us) {
+        c->rack_xmit_us = seg->xmit_us;
+        c->rack_rtt_us = rtt;
+    }
+}
+
+static void resend(struct sham_conn *c, struct sham_segment *seg, long long now) {
+    send_pbuf(c, seg->pb, seg->seq, ACK, seg->len);
+    log_event("RETX DATA SEQ=%u LEN=%u\n", seg->seq, seg->len);
+    c->retransmits++;
+    seg->retx = 1;
+    seg->xmit_us = now;
+}
+
+// Resends every segment sent before the latest delivered one that is
+// still missing a reordering window after it should have arrived, and
+// times the rest.
+static void rack_detect(struct sham_conn *c, long long now) {
+    long long reo_wnd = c->min_rtt_us / 4;
+    if (reo_wnd < SHAM_REO_MIN_US) reo_wnd = SHAM_REO_MIN_US;
+
+    c->rack_deadline = 0;
+    for (unsigned i = 0; i < c->sndq_sent; i++) {
+        struct sham_segment *seg = sndq_at(c, i);
+        if (seg->sacked || seg->xmit_us >= c->rack_xmit_us) continue;
+        long long deadline = seg->xmit_us + c->rack_rtt_us + reo_wnd;
+        if (now >= deadline) {
+            log_event("RACK LOST SEQ=%u\n", seg->seq);
+            resend(c, seg, now);
+        } else if (c->rack_deadline == 0 || deadline < c->rack_deadline) {
+            c->rack_deadline = deadline;
+        }
+    }
+}
+
+// Schedules a probe 2 * SRTT after the last send or ACK progress, so a
+// lost tail is found long before the retransmission timeout.
+static void arm_tlp(struct sham_conn *c, long long now) {
+    int outstanding = c->sndq_sent > 0 || (c->fin_sent && !c->fin_acked);
+    long long pto = 2 * c->srtt_us;
+    if (pto < SHAM_TLP_MIN_US) pto = SHAM_TLP_MIN_US;
+    c->tlp_deadline = (outstanding && c->srtt_us && !c->tlp_out) ? now + pto : 0;
+}
+
+// --- Send scheduler ---
+
+static void sched_wake(struct sham_conn *c) {
+    struct sham_endpoint *ep = c->ep;
+    if (c->sched_active) return;
+    c->sched_active = 1;
+    c->sched_next = NULL;
+    if (ep->sched_tail) ep->sched_tail->sched_next = c;
+    else ep->sched_head = c;
+    ep->sched_tail = c;
+}
+
+static void sched_remove(struct sham_conn *c) {
+    struct sham_endpoint *ep = c->ep;
+    if (!c->sched_active) return;
+    struct sham_conn **pp = &ep->sched_head, *prev = NULL;
+    while (*pp != c) {
+        prev = *pp;
+        pp = &(*pp)->sched_next;
+    }
+    *pp = c->sched_next;
+    if (ep->sched_tail == c) ep->sched_tail = prev;
+    c->sched_active = 0;
+}
+
+static void pace_refill(struct sham_endpoint *ep, long long now) {
+    if (!ep->cfg.rate) return;
+    ep->tokens += (long long)((now - ep->tokens_us) * (double)ep->cfg.rate / 1e6);
+    if (ep->tokens > SHAM_PACE_BURST) ep->tokens = SHAM_PACE_BURST;
+    ep->tokens_us = now;
+}
+
+// Sends the next queued segment if the window allows and returns its
+// length. A partial segment is held back while earlier data is
+// unacknowledged, unless force_send is set by the coalescing timer.
+// Returns 0 once the connection cannot send more for now, after closing
+// the FEC group and sending a queued FIN if everything is out.
+static size_t transmit_one(struct sham_conn *c, long long now) {
+    if (c->state == SHAM_CONNECTING) {
+        // A resuming client holds its SYN until the first segment fills
+        // up or the coalescing timer fires, and sends them together.
+        if (!c->syn_sent && (c->force_send || (c->sndq_count > 0 && sndq_at(c, 0)->len == seg_room(c, 0)))) {
+            c->coalesce_deadline = 0;
+            send_syn(c);
+            arm_rto(c, now);
+        }
+        return 0;
+    }
+    if (c->state != SHAM_ESTABLISHED && c->state != SHAM_CLOSING) return 0;
+
+    if (c->sndq_sent < c->sndq_count) {
+        struct sham_segment *seg = sndq_at(c, c->sndq_sent);
+        uint32_t inflight = c->snd_nxt - c->snd_una;
+        uint32_t wnd = WINDOW_SIZE * PAYLOAD_SIZE;
+        if (wnd > c->peer_window) wnd = c->peer_window;
+
+        // With nothing in flight one segment always goes out, which doubles
+        // as the zero-window probe.
+        if (inflight > 0 && inflight + seg->len > wnd) return 0;
+        // Only the last queued segment can still grow; those before it were
+        // sized to the mss in force when they were queued, which may since
+        // have grown (key share acknowledged, SYN options dropped)
+        int last = c->sndq_sent == c->sndq_count - 1 && !c->fin_queued;
+        if (last && seg->len < c->mss && inflight > 0 && !c->force_send) {
+            if (c->coalesce_deadline == 0) c->coalesce_deadline = now + SHAM_COALESCE_US;
+            return 0;
+        }
+
+        send_pbuf(c, seg->pb, seg->seq, ACK, seg->len);
+        log_event("SND DATA SEQ=%u LEN=%u\n", seg->seq, seg->len);
+        c->segments_sent++;
+        seg->xmit_us = now;
+        c->snd_nxt = seg->seq + seg->len;
+        c->sndq_sent++;
+        if (c->rto_deadline == 0) arm_rto(c, now);
+        arm_tlp(c, now);
+        if (c->fec_tx) fec_add(c, seg);
+        c->force_send = 0;
+        return seg->len;
+    }
+
+    c->coalesce_deadline = 0;
+    // Nothing more to send for now: close the group so the tail is covered
+    if (c->fec_tx && c->fec_tx->count > 0) fec_send_group(c);
+
+    if (c->fin_queued && !c->fin_sent) {
+        c->fin_sent = 1;
+        send_fin(c);
+        if (c->rto_deadline == 0) arm_rto(c, now);
+        arm_tlp(c, now);
+    }
+    return 0;
+}
+
+// Deficit round robin over the connections with data ready. Each turn
+// adds SHAM_QUANTUM * weight to a connection's deficit and lets it send
+// segments while they fit; a connection that runs dry or is blocked by
+// its window leaves the ring and forfeits what is left. Stops early when
+// the pacing bucket is empty and resumes at pace_deadline.
+static void endpoint_send(struct sham_endpoint *ep) {
+    long long now = now_us(ep);
+    pace_refill(ep, now);
+    ep->pace_deadline = 0;
+
+    while (ep->sched_head) {
+        if (ep->cfg.rate && ep->tokens <= 0) {
+            ep->pace_deadline = now + (long long)((1 - ep->tokens) * 1e6 / (double)ep->cfg.rate);
+            return;
+        }
+        struct sham_conn *c = ep->sched_head;
+        sched_remove(c);
+        c->deficit += (size_t)SHAM_QUANTUM * c->weight;
+
+        int ready = 1;
+        while (!ep->cfg.rate || ep->tokens > 0) {
+            if (c->sndq_sent < c->sndq_count && sndq_at(c, c->sndq_sent)->len > c->deficit) break;
+            size_t n = transmit_one(c, now);
+            if (n == 0) {
+                ready = 0;
+                break;
+            }
+            c->deficit -= n;
+        }
+        if (ready) {
+            sched_wake(c);
+        } else {
+            c->deficit = 0;
+            c->force_send = 0;
+        }
+    }
+}
+
+// Marks the connection ready and runs the scheduler. 'force' lets its next
+// segment go out even if partial.
+static void transmit(struct sham_conn *c, int force) {
+    if (force) c->force_send = 1;
+    sched_wake(c);
+    endpoint_send(c->ep);
+}
+
+// Go-back-N over everything the peer has not SACKed. The timeout stays
+// fixed at RTO_MS; it is the backstop when RACK and TLP get no feedback.
+static void retransmit(struct sham_conn *c) {
+    long long now = now_us(c->ep);
+
+    if (c->state == SHAM_CONNECTING) {
+        send_syn(c);
+        return;
+    }
+
+    log_event("TIMEOUT SEQ=%u\n", c->snd_una);
+    for (unsigned i = 0; i < c->sndq_sent; i++) {
+        struct sham_segment *seg = sndq_at(c, i);
+        if (!seg->sacked) resend(c, seg, now);
+    }
+    if (c->sndq_sent == 0 && c->fin_sent && !c->fin_acked) send_fin(c);
+}
+
+// Tail loss probe: new data if the window allows, else the last segment
+// the peer has not SACKed (or the FIN) again. Its ACK carries the SACK
+// blocks RACK needs, and it repairs a lost retransmission directly.
+static void tail_probe(struct sham_conn *c) {
+    long long now = now_us(c->ep);
+    c->tlp_out = 1;
+    c->tlp_deadline = 0;
+    c->tail_probes++;
+
+    uint32_t before = c->snd_nxt;
+    transmit(c, 1);
+    if (c->snd_nxt != before) return;
+
+    for (unsigned i = c->sndq_sent; i-- > 0; ) {
+        struct sham_segment *seg = sndq_at(c, i);
+        if (seg->sacked) continue;
+        log_event("TLP SEQ=%u\n", seg->seq);
+        resend(c, seg, now);
+        return;
+    }
+    if (c->fin_sent && !c->fin_acked) {
+        log_event("TLP FIN SEQ=%u\n", c->snd_end);
+        send_fin(c);
+    }
+}
+
+static void flush(struct sham_conn *c) {
+    transmit(c, 0);
+    if (c->ack_pending && c->state != SHAM_CONNECTING) send_ack(c);
+}
+
+// --- Input ---
+
+static void update_state(struct sham_conn *c) {
+    if (c->fin_acked && c->peer_fin && c->state != SHAM_FAILED) {
+        c->state = SHAM_CLOSED;
+        c->rto_deadline = 0;
+        c->coalesce_deadline = 0;
+        c->rack_deadline = 0;
+        c->tlp_deadline = 0;
+    }
+}
+
+static void on_ack(struct sham_conn *c, uint32_t ack, uint16_t window) {
+    uint32_t limit = c->snd_nxt + (c->fin_sent ? 1 : 0);
+    c->peer_window = window;
+    if ((int32_t)(ack - c->snd_una) <= 0 || (int32_t)(ack - limit) > 0) return;
+
+    long long now = now_us(c->ep);
+    log_event("RCV ACK=%u\n", ack);
+    while (c->sndq_sent > 0) {
+        struct sham_segment *seg = sndq_at(c, 0);
+        if ((int32_t)(seg->seq + seg->len - ack) > 0) break;
+        if (!seg->sacked) rack_delivered(c, seg, now);
+        pbuf_unref(seg->pb);
+        seg->pb = NULL;
+        c->sndq_head = (c->sndq_head + 1) % SHAM_SNDQ;
+        c->sndq_count--;
+        c->sndq_sent--;
+    }
+    c->snd_una = (int32_t)(ack - c->snd_nxt) > 0 ? c->snd_nxt : ack;
+    if (c->fin_sent && ack == limit) c->fin_acked = 1;
+
+    c->retries = 0;
+    c->tlp_out = 0;
+    arm_rto(c, now);
+    arm_tlp(c, now);
+}
+
+static void on_sack(struct sham_conn *c, const char *buf, size_t len) {
+    if (len < 1) return;
+    int n = (uint8_t)buf[0];
+    if (n > SHAM_SACK_MAX || len < 1 + 8 * (size_t)n) return;
+
+    long long now = now_us(c->ep);
+    for (int b = 0; b < n; b++) {
+        uint32_t lo, hi;
+        memcpy(&lo, buf + 1 + 8 * b, 4);
+        memcpy(&hi, buf + 5 + 8 * b, 4);
+        lo = ntohl(lo);
+        hi = ntohl(hi);
+        log_event("RCV SACK %u-%u\n", lo, hi);
+        for (unsigned i = 0; i < c->sndq_sent; i++) {
+            struct sham_segment *seg = sndq_at(c, i);
+            if (seg->sacked || (int32_t)(seg->seq - lo) < 0 || (int32_t)(seg->seq + seg->len - hi) > 0) continue;
+            seg->sacked = 1;
+            rack_delivered(c, seg, now);
+        }
+    }
+}
+
+static void deliver(struct sham_conn *c, const char *data, size_t len) {
+    size_t take = len < rcv_free(c) ? len : rcv_free(c);
+    size_t tail = (c->rcv_head + c->rcv_len) % SHAM_RCVBUF;
+    size_t first = SHAM_RCVBUF - tail < take ? SHAM_RCVBUF - tail : take;
+    memcpy(c->rcvbuf + tail, data, first);
+    memcpy(c->rcvbuf, data + first, take - first);
+    c->rcv_len += take;
+    c->rcv_nxt += take;
+}
+
+// Hands over any held segments that have become in-order
+static void drain_ooo(struct sham_conn *c) {
+    int progress = 1;
+    while (progress) {
+        progress = 0;
+        for (int i = 0; i < SHAM_OOO_SLOTS; i++) {
+            struct sham_segment *seg = &c->ooo[i];
+            if (!seg->pb) continue;
+            uint32_t off = c->rcv_nxt - seg->seq;
+            if ((int32_t)off < 0) continue;
+            if (off < seg->len) deliver(c, seg_data(seg) + off, seg->len - off);
+            pbuf_unref(seg->pb);
+            seg->pb = NULL;
+            progress = 1;
+        }
+    }
+}
+
+// Holds on to the received buffer itself; nothing is copied until the
+// segment becomes in-order.
+static void hold_ooo(struct sham_conn *c, uint32_t seq, struct sham_pbuf *pb, size_t len) {
+    // Only keep what fits in the advertised window
+    if (seq - c->rcv_nxt + len > rcv_free(c)) return;
+
+    int slot = -1;
+    for (int i = 0; i < SHAM_OOO_SLOTS; i++) {
+        if (c->ooo[i].pb) {
+            if (c->ooo[i].seq == seq) return; // Duplicate
+        } else if (slot < 0) {
+            slot = i;
+        }
+    }
+    if (slot < 0 || pbuf_charge(pb, &c->mem) < 0) return;
+
+    pbuf_ref(pb);
+    c->ooo[slot].seq = seq;
+    c->ooo[slot].len = len;
+    c->ooo[slot].pb = pb;
+}
+
+static void on_data(struct sham_conn *c, uint32_t seq, struct sham_pbuf *pb, size_t len) {
+    log_event("RCV DATA SEQ=%u LEN=%zu\n", seq, len);
+    c->ack_pending = 1;
+
+    // Accept any segment that covers rcv_nxt; a retransmission may overlap
+    // data we already have.
+    uint32_t off = c->rcv_nxt - seq;
+    if ((int32_t)off < 0) {
+        hold_ooo(c, seq, pb, len);
+        return;
+    }
+    if (off >= len) return;
+    deliver(c, pb->pkt.data + off, len - off);
+    drain_ooo(c);
+}
+
+// --- Encryption ---
+
+// Client side of the key exchange, from the SYN-ACK's options. Returns -1
+// if the server did not take up encryption and -2 if its confirmation MAC
+// is wrong (a different pre-shared key, or tampering).
+static int conn_client_keys(struct sham_conn *c, const char *opts, size_t len, uint32_t server_isn) {
+    const struct sham_config *cfg = &c->ep->cfg;
+    uint8_t server_pub[AEAD_SHARE_LEN], confirm[AEAD_CONFIRM_LEN], expect[AEAD_CONFIRM_LEN];
+    int off = aead_read_option(opts, len, server_pub, confirm);
+    if (off < 0) return -1;
+
+    struct aead_keys k;
+    if (aead_derive(&k, c->kx_priv, server_pub, c->kx_pub, server_pub, c->iss, server_isn, cfg->psk,
+                    cfg->psk_len) < 0) {
+        return -2;
+    }
+    aead_confirm(k.confirm, opts, off + 2 + AEAD_SHARE_LEN, expect);
+    if (CRYPTO_memcmp(confirm, expect, AEAD_CONFIRM_LEN) != 0) {
+        OPENSSL_cleanse(&k, sizeof(k));
+        return -2;
+    }
+    c->aead = aead_new(&k, 0);
+    OPENSSL_cleanse(&k, sizeof(k));
+    if (!c->aead) return -1;
+    OPENSSL_cleanse(c->kx_priv, sizeof(c->kx_priv));
+    log_event("AEAD AES-128-GCM\n");
+    return 0;
+}
+
+// The secret behind the listener's key pairs for handshakes begun in
+// 'slot'. A fresh one is drawn every cookie slot and the old one dropped
+// a slot later, in step with the cookies; none is ever written out.
+static const uint8_t *kx_secret(struct sham_endpoint *ep, uint32_t slot) {
+    uint32_t now = cookie_slot(wall_s(ep));
+    if (now != ep->kx_slot) {
+        if (now == ep->kx_slot + 1) memcpy(ep->kx_secret[1], ep->kx_secret[0], COOKIE_KEY_LEN);
+        else cookie_init_key(ep->kx_secret[1]);
+        cookie_init_key(ep->kx_secret[0]);
+        ep->kx_slot = now;
+    }
+    if (slot == now) return ep->kx_secret[0];
+    if (slot == now - 1) return ep->kx_secret[1];
+    return NULL;
+}
+
+// Listener side, once a handshake carrying the client's key checks out.
+// The listener's key pair is the one its stateless SYN-ACK advertised in
+// cookie slot 'slot'.
+static int conn_server_keys(struct sham_conn *c, const uint8_t *client_pub, uint32_t slot) {
+    const struct sham_config *cfg = &c->ep->cfg;
+    uint32_t client_isn = c->rcv_nxt - 1;
+    const uint8_t *secret = kx_secret(c->ep, slot);
+    struct aead_keys k;
+    if (!secret || aead_server_keypair(secret, &c->peer, client_isn, c->iss, c->kx_priv, c->kx_pub) < 0 ||
+        aead_derive(&k, c->kx_priv, client_pub, client_pub, c->kx_pub, client_isn, c->iss, cfg->psk,
+                    cfg->psk_len) < 0) {
+        return -1;
+    }
+    OPENSSL_cleanse(c->kx_priv, sizeof(c->kx_priv));
+    c->aead = aead_new(&k, 1);
+    OPENSSL_cleanse(&k, sizeof(k));
+    if (!c->aead) return -1;
+    c->mss = conn_mss(c);
+    log_event("AEAD AES-128-GCM\n");
+    return 0;
+}
+
+// Authenticates and decrypts a received datagram in place. Handshake
+// packets travel in the clear; anything else that fails is dropped.
+static int conn_open(struct sham_conn *c, struct sham_pbuf *pb) {
+    uint16_t flags = ntohs(pb->pkt.header.flags);
+    if (!c->aead || (flags & SYN)) return 0;
+
+    size_t len;
+    if (aead_open(c->aead, &pb->pkt.header, sizeof(pb->pkt.header), flags & KEY, (uint8_t *)pb->pkt.data,
+                  pb->len - sizeof(pb->pkt.header), &len) < 0) {
+        log_event("DROP AUTH SEQ=%u\n", ntohl(pb->pkt.header.seq_num));
+        return -1;
+    }
+    pb->len = sizeof(pb->pkt.header) + len;
+    if (!c->passive && !c->key_acked) {
+        // The server has our key share; stop sending it
+        c->key_acked = 1;
+        c->mss = conn_mss(c);
+    }
+    return 0;
+}
+
+static void conn_input(struct sham_conn *c, struct sham_pbuf *pb) {
+    const struct sham_packet *packet = &pb->pkt;
+    size_t n = pb->len;
+    uint16_t flags = ntohs(packet->header.flags);
+    uint32_t seq = ntohl(packet->header.seq_num);
+    uint32_t ack = ntohl(packet->header.ack_num);
+    size_t len = n - sizeof(packet->header);
+
+    // Only an active open waits in CONNECTING; the listener keeps no state
+    // until the handshake is complete.
+    if (c->state == SHAM_CONNECTING) {
+        // The SYN-ACK acknowledges the SYN and possibly its 0-RTT data
+        if ((flags & (SYN | ACK)) != (SYN | ACK) || (int32_t)(ack - (c->iss + 1)) < 0 ||
+            (int32_t)(ack - c->snd_nxt) > 0) {
+            return;
+        }
+        log_event("RCV SYN-ACK SEQ=%u ACK=%u\n", seq, ack);
+        if (c->ep->cfg.encrypt) {
+            int rc = conn_client_keys(c, packet->data, len, seq);
+            if (rc < 0) {
+                log_event(rc == -1 ? "ENCRYPTION REFUSED\n" : "DROP AUTH SYN-ACK\n");
+                if (rc == -1) {
+                    c->state = SHAM_FAILED;
+                    c->rto_deadline = 0;
+                    c->coalesce_deadline = 0;
+                }
+                return;
+            }
+        }
+        // The handshake gives the first RTT sample unless the SYN was resent
+        if (c->retries == 0) rtt_sample(c, now_us(c->ep) - c->syn_xmit_us);
+        c->codec = compress_read_option(packet->data, len) & c->ep->cfg.codecs;
+        uint8_t mode, k, m;
+        if (fec_read_option(packet->data, len, &mode, &k, &m) == 0 && mode <= c->ep->cfg.fec) {
+            fec_enable(c, mode, k, m);
+            log_event("FEC MODE=%u K=%u M=%u\n", c->fec_mode, c->fec_k, c->fec_m);
+        }
+        c->mss = conn_mss(c);
+        if (token_read_option(packet->data, len, c->token.data) == 0) c->token.len = TOKEN_LEN;
+        c->rcv_nxt = seq + 1;
+        c->state = c->fin_queued ? SHAM_CLOSING : SHAM_ESTABLISHED;
+        c->retries = 0;
+        if (ack != c->snd_nxt) {
+            // The server did not take our 0-RTT data; send it again normally
+            c->sndq_sent = 0;
+            c->snd_nxt = c->snd_una;
+        }
+        on_ack(c, ack, ntohs(packet->header.window_size));
+        arm_rto(c, now_us(c->ep));
+        c->idle_deadline = now_us(c->ep) + SHAM_KEEPALIVE_US;
+        send_ack(c);
+        log_event("SND ACK FOR SYN\n");
+        return;
+    }
+
+    if (c->passive) {
+        // Only the real peer can acknowledge our SYN-ACK; until it has,
+        // nothing it sends keeps the connection alive
+        if (!c->verified && (flags & ACK) && (int32_t)(ack - (c->iss + 1)) >= 0 &&
+            (int32_t)(ack - c->snd_nxt) <= 0) {
+            c->verified = 1;
+            c->ep->unverified--;
+        }
+        if (c->verified) c->idle_deadline = now_us(c->ep) + SHAM_IDLE_US;
+    }
+
+    if (flags & SYN) {
+        // Duplicate handshake packet: the peer missed our reply
+        if (c->passive) send_syn_ack(c);
+        else c->ack_pending = 1;
+        return;
+    }
+
+    // Simulate packet loss. ACKs carrying only a loss report or SACK
+    // blocks are not data and get through, like bare ACKs.
+    int pure = (flags & (LOSS | SACK)) && !(flags & (FIN | FEC));
+    if ((len > 0 || (flags & FIN)) && !pure && (double)rand() / RAND_MAX < c->ep->cfg.loss_rate) {
+        log_event("DROP DATA SEQ=%u\n", seq);
+        return;
+    }
+
+    if (flags & ACK) on_ack(c, ack, ntohs(packet->header.window_size));
+    if (flags & FEC) {
+        fec_on_parity(c, seq, pb, len);
+    } else if (flags & (LOSS | SACK)) {
+        size_t off = 0;
+        if (flags & LOSS) {
+            fec_on_report(c, packet->data, len);
+            off = 4;
+        }
+        if ((flags & SACK) && len > off) on_sack(c, packet->data + off, len - off);
+    } else if (len > 0) {
+        on_data(c, seq, pb, len);
+        if (c->fec_rx) fec_on_data(c, seq, pb, len);
+    }
+    if (flags & ACK) rack_detect(c, now_us(c->ep));
+    if (flags & FIN) {
+        log_event("RCV FIN SEQ=%u\n", seq);
+        if (seq == c->rcv_nxt && !c->peer_fin) {
+            c->rcv_nxt++;
+            c->peer_fin = 1;
+        }
+        c->ack_pending = 1;
+    }
+    update_state(c);
+}
+
+// --- Connections and endpoints ---
+
+static struct sham_conn *conn_new(struct sham_endpoint *ep, const struct sockaddr_in *peer) {
+    struct sham_conn *c = calloc(1, sizeof(*c));
+    if (!c) return NULL;
+    c->sndq = calloc(SHAM_SNDQ, sizeof(*c->sndq));
+    c->ooo = calloc(SHAM_OOO_SLOTS, sizeof(*c->ooo));
+    c->rcvbuf = malloc(SHAM_RCVBUF);
+    if (!c->sndq || !c->ooo || !c->rcvbuf) {
+        free(c->sndq);
+        free(c->ooo);
+        free(c->rcvbuf);
+        free(c);
+        return NULL;
+    }
+    c->ep = ep;
+    c->peer = *peer;
+    c->state = SHAM_CONNECTING;
+    c->iss = rand() % 10000;
+    c->snd_una = c->snd_nxt = c->snd_end = c->iss + 1;
+    c->peer_window = BUFFER_SIZE;
+    c->mss = PAYLOAD_SIZE;
+    c->weight = 1;
+    c->mem.limit = ep->cfg.mem_limit ? ep->cfg.mem_limit : SHAM_MEM_LIMIT;
+    c->next = ep->conns;
+    ep->conns = c;
+    return c;
+}
+
+static void conn_free(struct sham_conn *c) {
+    if (!c->verified && c->passive) c->ep->unverified--;
+    sched_remove(c);
+    // Queued datagrams may still reference buffers charged to c
+    endpoint_flush(c->ep);
+    for (unsigned i = 0; i < c->sndq_count; i++) pbuf_unref(sndq_at(c, i)->pb);
+    for (int i = 0; i < SHAM_OOO_SLOTS; i++) {
+        if (c->ooo[i].pb) pbuf_unref(c->ooo[i].pb);
+    }
+    if (c->fec_rx) {
+        for (int i = 0; i < FEC_HISTORY; i++) {
+            if (c->fec_rx->history[i].pb) pbuf_unref(c->fec_rx->history[i].pb);
+        }
+        for (int i = 0; i < FEC_PARITY_SLOTS; i++) {
+            if (c->fec_rx->parity[i].pb) pbuf_unref(c->fec_rx->parity[i].pb);
+        }
+    }
+    aead_free(c->aead);
+    OPENSSL_cleanse(c->kx_priv, sizeof(c->kx_priv));
+    free(c->fec_tx);
+    free(c->fec_rx);
+    free(c->sndq);
+    free(c->ooo);
+    free(c->rcvbuf);
+    free(c);
+}
+
+static struct sham_conn *find_conn(struct sham_endpoint *ep, const struct sockaddr_in *from) {
+    for (struct sham_conn *c = ep->conns; c; c = c->next) {
+        if (c->peer.sin_addr.s_addr == from->sin_addr.s_addr && c->peer.sin_port == from->sin_port) {
+            return c;
+        }
+    }
+    return NULL;
+}
+
+// Negotiated options packed into the low COOKIE_OPT_BITS of a cookie:
+// [m 3][k-1 4][fec mode 2][codec 2]
+static uint16_t cookie_pack(uint8_t codec, uint8_t mode, uint8_t k, uint8_t m) {
+    uint16_t kbits = mode != SHAM_FEC_OFF ? (uint16_t)(k - 1) : 0;
+    return (codec & 0x3) | (mode & 0x3) << 2 | (kbits & 0xf) << 4 | (m & 0x7) << 8;
+}
+
+static void cookie_unpack(uint16_t opts, uint8_t *codec, uint8_t *mode, uint8_t *k, uint8_t *m) {
+    *codec = opts & 0x3;
+    *mode = (opts >> 2) & 0x3;
+    *k = ((opts >> 4) & 0xf) + 1;
+    *m = (opts >> 8) & 0x7;
+}
+
+// Stateless SYN-ACK: everything needed to finish the handshake travels in
+// the cookie, so a flood of SYNs costs the listener nothing.
+// With encryption the listener derives this handshake's key pair and
+// session keys here only to sign the SYN-ACK, and forgets them again.
+static void send_cookie(struct sham_endpoint *ep, const struct sham_pbuf *syn, uint8_t codec, uint8_t mode,
+                        uint8_t k, uint8_t m, const uint8_t *client_pub) {
+    uint32_t peer_isn = ntohl(syn->pkt.header.seq_num);
+    uint32_t now = wall_s(ep);
+    uint32_t cookie = cookie_make(ep->key, &syn->addr, peer_isn, cookie_pack(codec, mode, k, m), now);
+    uint8_t priv[AEAD_SHARE_LEN], pub[AEAD_SHARE_LEN];
+    struct aead_keys keys;
+    if (client_pub) {
+        const uint8_t *secret = kx_secret(ep, cookie_slot(now));
+        if (!secret || aead_server_keypair(secret, &syn->addr, peer_isn, cookie, priv, pub) < 0 ||
+            aead_derive(&keys, priv, client_pub, client_pub, pub, peer_isn, cookie, ep->cfg.psk,
+                        ep->cfg.psk_len) < 0) {
+            return;
+        }
+        OPENSSL_cleanse(priv, sizeof(priv));
+    }
+    struct sham_pbuf *pb = pool_get(&ep->pool);
+    if (!pb) return;
+
+    int len = syn_ack_options(ep, &syn->addr, pb->pkt.data, codec, mode, k, m, client_pub ? pub : NULL,
+                              keys.confirm);
+    if (client_pub) OPENSSL_cleanse(&keys, sizeof(keys));
+    pb->pkt.header.seq_num = htonl(cookie);
+    pb->pkt.header.ack_num = htonl(peer_isn + 1);
+    pb->pkt.header.flags = htons(SYN | ACK);
+    pb->pkt.header.window_size = htons((uint16_t)SHAM_RCVBUF);
+    pb->len = sizeof(pb->pkt.header) + len;
+    endpoint_queue(ep, pb, &syn->addr, NULL);
+    pbuf_unref(pb);
+    log_event("SND SYN-ACK SEQ=%u ACK=%u\n", cookie, peer_isn + 1);
+}
+
+// Creates the listener's side of a connection whose handshake checked out
+static struct sham_conn *conn_accept(struct sham_endpoint *ep, const struct sockaddr_in *peer, uint32_t peer_isn,
+                                     uint32_t iss, uint16_t window, uint8_t codec, uint8_t mode, uint8_t k,
+                                     uint8_t m) {
+    struct sham_conn *c = conn_new(ep, peer);
+    if (!c) return NULL;
+    c->passive = 1;
+    c->verified = 1;
+    c->idle_deadline = now_us(ep) + SHAM_IDLE_US;
+    c->syn_sent = 1;
+    c->iss = iss;
+    c->snd_una = c->snd_nxt = c->snd_end = iss + 1;
+    c->rcv_nxt = peer_isn + 1;
+    c->peer_window = window;
+    c->codec = codec;
+    c->state = SHAM_ESTABLISHED;
+    if (mode != SHAM_FEC_OFF) {
+        fec_enable(c, mode, k, m);
+        log_event("FEC MODE=%u K=%u M=%u\n", c->fec_mode, c->fec_k, c->fec_m);
+    }
+    c->mss = conn_mss(c);
+    return c;
+}
+
+static void conn_discard(struct sham_conn *c) {
+    struct sham_conn **pp = &c->ep->conns;
+    while (*pp != c) pp = &(*pp)->next;
+    *pp = c->next;
+    conn_free(c);
+}
+
+// Handles a datagram that matches no connection. A listener answers a SYN
+// with a cookie and creates state only for an ACK that returns a valid
+// one, or for a SYN carrying a valid resumption token.
+static void endpoint_accept(struct sham_endpoint *ep, struct sham_pbuf *pb) {
+    struct sham_packet *packet = &pb->pkt;
+    int len = pb->len - sizeof(packet->header);
+    uint16_t flags = ntohs(packet->header.flags);
+    uint32_t seq = ntohl(packet->header.seq_num);
+    uint32_t ack = ntohl(packet->header.ack_num);
+    uint16_t window = ntohs(packet->header.window_size);
+    uint8_t codec, mode, k, m;
+    if (!ep->listening) return;
+    uint32_t now = wall_s(ep);
+
+    if (flags == SYN) {
+        int data_off;
+        int opt_len = syn_opts_len(packet->data, len, &data_off);
+        log_event("RCV SYN SEQ=%u\n", seq);
+        codec = compress_choose_codec(compress_read_option(packet->data, opt_len) & ep->cfg.codecs);
+        if (fec_read_option(packet->data, opt_len, &mode, &k, &m) < 0 || mode > ep->cfg.fec) mode = SHAM_FEC_OFF;
+        fec_negotiate(&mode, &k, &m);
+        uint8_t client_pub[AEAD_SHARE_LEN];
+        int encrypt = ep->cfg.encrypt && aead_read_option(packet->data, opt_len, client_pub, NULL) >= 0;
+        if (!encrypt && ep->cfg.psk) return;
+
+        // A token skips the return-routability check, so only a few such
+        // connections may wait for their peer's first ACK at once
+        uint8_t token[TOKEN_LEN];
+        if (ep->unverified >= SHAM_UNVERIFIED_MAX || token_read_option(packet->data, opt_len, token) < 0 ||
+            token_check(ep->key, &pb->addr, token, now) < 0 || token_use(ep->token_cache, token, now) < 0) {
+            send_cookie(ep, pb, codec, mode, k, m, encrypt ? client_pub : NULL);
+            return;
+        }
+
+        // Returning client: take its 0-RTT data right away
+        uint32_t iss = cookie_make(ep->key, &pb->addr, seq, cookie_pack(codec, mode, k, m), now);
+        struct sham_conn *c = conn_accept(ep, &pb->addr, seq, iss, window, codec, mode, k, m);
+        if (!c) return;
+        c->verified = 0;
+        c->idle_deadline = now_us(ep) + SHAM_HANDSHAKE_US;
+        ep->unverified++;
+        if (encrypt && conn_server_keys(c, client_pub, cookie_slot(now)) < 0) {
+            conn_discard(c);
+            return;
+        }
+        // An encrypting client sends no 0-RTT data
+        size_t early = encrypt ? 0 : len - data_off;
+        log_event("RCV TOKEN EARLY=%zu\n", early);
+        if (early > 0) {
+            memmove(packet->data, packet->data + data_off, early);
+            on_data(c, seq + 1, pb, early);
+        }
+        send_syn_ack(c);
+        return;
+    }
+
+    // Anything else has to finish a handshake: SEQ is the client's ISN + 1
+    // and ACK our cookie + 1. The first data segment qualifies as well, so
+    // a lost handshake ACK is repaired by the client's retransmission.
+    // An encrypting client carries its key share in these packets (KEY).
+    if (!(flags & ACK) || (flags & SYN)) return;
+    const uint8_t *client_pub = NULL;
+    if (flags & KEY) {
+        client_pub = aead_share((const uint8_t *)packet->data, len);
+        if (!client_pub || !ep->cfg.encrypt) return;
+    } else if (ep->cfg.psk) {
+        return;
+    }
+    uint16_t opts;
+    uint32_t slot;
+    if (cookie_check(ep->key, &pb->addr, seq - 1, ack - 1, &opts, &slot, now) < 0) return;
+    cookie_unpack(opts, &codec, &mode, &k, &m);
+    struct sham_conn *c = conn_accept(ep, &pb->addr, seq - 1, ack - 1, window, codec, mode, k, m);
+    if (!c) return;
+    if (client_pub && (conn_server_keys(c, client_pub, slot) < 0 || conn_open(c, pb) < 0)) {
+        conn_discard(c);
+        return;
+    }
+    log_event("RCV ACK FOR SYN\n");
+    conn_input(c, pb);
+}
+
+// Drains the socket SHAM_BATCH datagrams at a time, straight into pool
+// buffers. A connection that wants to keep a datagram (out of order, or
+// for FEC) takes a reference; the rest go back to the pool.
+static void endpoint_input(struct sham_endpoint *ep) {
+    struct sham_datagram d[SHAM_BATCH];
+
+    while (1) {
+        int n = 0;
+        for (; n < SHAM_BATCH; n++) {
+            if (!ep->rx[n] && !(ep->rx[n] = pool_get(&ep->pool))) break;
+            d[n].data = &ep->rx[n]->pkt;
+            d[n].len = sizeof(ep->rx[n]->pkt);
+            d[n].addr = &ep->rx[n]->addr;
+        }
+        if (n == 0) break;
+
+        int r = ep->io->recv(ep->io->ctx, ep->fd, d, n);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (int i = 0; i < r; i++) {
+            struct sham_pbuf *pb = ep->rx[i];
+            ep->rx[i] = NULL;
+            if (d[i].len >= sizeof(pb->pkt.header)) {
+                pb->len = d[i].len;
+                struct sham_conn *c = find_conn(ep, &pb->addr);
+                if (!c) endpoint_accept(ep, pb);
+                else if (conn_open(c, pb) == 0) conn_input(c, pb);
+            }
+            pbuf_unref(pb);
+        }
+        // Keep the unused buffers at the front for the next round
+        for (int i = r, j = 0; i < n; i++, j++) {
+            ep->rx[j] = ep->rx[i];
+            ep->rx[i] = NULL;
+        }
+        if (r < n) break;
+    }
+
+    for (struct sham_conn *c = ep->conns; c; c = c->next) flush(c);
+}
+
+// Gives up on a connection. One the application has not accepted is freed
+// on the spot, as nothing else ever would.
+static void conn_fail(struct sham_conn *c) {
+    log_event("CONNECTION FAILED\n");
+    c->state = SHAM_FAILED;
+    c->rto_deadline = 0;
+    c->coalesce_deadline = 0;
+    c->rack_deadline = 0;
+    c->tlp_deadline = 0;
+    c->idle_deadline = 0;
+    if (c->passive && !c->accepted) conn_discard(c);
+}
+
+static void endpoint_timers(struct sham_endpoint *ep) {
+    long long now = now_us(ep);
+
+    if (ep->pace_deadline && now >= ep->pace_deadline) endpoint_send(ep);
+
+    struct sham_conn *next;
+    for (struct sham_conn *c = ep->conns; c; c = next) {
+        next = c->next;
+        if (c->state == SHAM_CLOSED) c->idle_deadline = 0;
+        if (c->idle_deadline && now >= c->idle_deadline) {
+            if (c->passive) {
+                log_event("CONNECTION IDLE\n");
+                conn_fail(c);
+                continue;
+            }
+            // Keeps the listener from timing out a quiet client
+            send_ack(c);
+            c->idle_deadline = now + SHAM_KEEPALIVE_US;
+        }
+        if (c->coalesce_deadline && now >= c->coalesce_deadline) {
+            c->coalesce_deadline = 0;
+            transmit(c, 1);
+        }
+        if (c->rack_deadline && now >= c->rack_deadline) rack_detect(c, now);
+        if (c->tlp_deadline && now >= c->tlp_deadline) tail_probe(c);
+        if (c->rto_deadline && now >= c->rto_deadline) {
+            if (++c->retries > SHAM_MAX_RETRIES) {
+                conn_fail(c);
+                continue;
+            }
+            retransmit(c);
+            c->rto_deadline = now + RTO_MS * 1000LL;
+        }
+    }
+}
+
+static int endpoint_timeout(const struct sham_endpoint *ep) {
+    long long next = ep->pace_deadline;
+    for (const struct sham_conn *c = ep->conns; c; c = c->next) {
+        if (c->rto_deadline && (next == 0 || c->rto_deadline < next)) next = c->rto_deadline;
+        if (c->coalesce_deadline && (next == 0 || c->coalesce_deadline < next)) next = c->coalesce_deadline;
+        if (c->rack_deadline && (next == 0 || c->rack_deadline < next)) next = c->rack_deadline;
+        if (c->tlp_deadline && (next == 0 || c->tlp_deadline < next)) next = c->tlp_deadline;
+        if (c->idle_deadline && (next == 0 || c->idle_deadline < next)) next = c->idle_deadline;
+    }
+    if (next == 0) return -1;
+
+    long long wait = next - now_us(ep);
+    return wait > 0 ? (int)((wait + 999) / 1000) : 0;
+}
+
+static int endpoint_process(struct sham_endpoint *ep) {
+    endpoint_input(ep);
+    endpoint_timers(ep);
+    endpoint_flush(ep);
+    return 0;
+}
+
+// Opens the endpoint's datagram socket, bound to 'port' unless it is 0
+static int endpoint_open(struct sham_endpoint *ep, const struct sham_config *cfg, uint16_t port) {
+    memset(ep, 0, sizeof(*ep));
+    if (cfg) ep->cfg = *cfg;
+    ep->io = ep->cfg.io ? ep->cfg.io : &sham_udp_io;
+    ep->fd = ep->io->open(ep->io->ctx, port);
+    if (ep->fd < 0) return -1;
+    pool_init(&ep->pool);
+    return 0;
+}
+
+// Called once every connection on the endpoint is gone
+static void endpoint_close(struct sham_endpoint *ep) {
+    endpoint_flush(ep);
+    for (int i = 0; i < SHAM_BATCH; i++) {
+        if (ep->rx[i]) pbuf_unref(ep->rx[i]);
+    }
+    pool_destroy(&ep->pool);
+    free(ep->token_cache);
+    OPENSSL_cleanse(ep->kx_secret, sizeof(ep->kx_secret));
+    ep->io->close(ep->io->ctx, ep->fd);
+}
+
+// --- Listener API ---
+
+struct sham_listener *sham_listen(uint16_t port, const struct sham_config *cfg) {
+    struct sham_listener *l = malloc(sizeof(*l));
+    if (!l) return NULL;
+    if (endpoint_open(&l->ep, cfg, port) < 0) {
+        free(l);
+        return NULL;
+    }
+    l->ep.listening = 1;
+    cookie_init_key(l->ep.kx_secret[0]);
+    cookie_init_key(l->ep.kx_secret[1]);
+    l->ep.kx_slot = cookie_slot(wall_s(&l->ep));
+    l->ep.token_cache = calloc(1, sizeof(*l->ep.token_cache));
+    if (!l->ep.token_cache) {
+        endpoint_close(&l->ep);
+        free(l);
+        return NULL;
+    }
+    if (cfg && cfg->key) memcpy(l->ep.key, cfg->key, COOKIE_KEY_LEN);
+    else cookie_init_key(l->ep.key);
+    return l;
+}
+
+// Returns the next fully established connection, or NULL with errno EAGAIN
+struct sham_conn *sham_accept(struct sham_listener *l) {
+    for (struct sham_conn *c = l->ep.conns; c; c = c->next) {
+        if (!c->accepted && c->state != SHAM_CONNECTING && c->state != SHAM_FAILED) {
+            c->accepted = 1;
+            return c;
+        }
+    }
+    errno = EAGAIN;
+    return NULL;
+}
+
+int sham_listener_fd(const struct sham_listener *l) {
+    return l->ep.fd;
+}
+
+int sham_listener_timeout(const struct sham_listener *l) {
+    return endpoint_timeout(&l->ep);
+}
+
+int sham_listener_process(struct sham_listener *l) {
+    return endpoint_process(&l->ep);
+}
+
+void sham_listener_close(struct sham_listener *l) {
+    struct sham_conn *c = l->ep.conns;
+    while (c) {
+        struct sham_conn *next = c->next;
+        conn_free(c);
+        c = next;
+    }
+    endpoint_close(&l->ep);
+    free(l);
+}
+
+// --- Connection API ---
+
+struct sham_conn *sham_connect(const char *ip, uint16_t port, const struct sham_config *cfg) {
+    struct sockaddr_in peer;
+    memset(&peer, 0, sizeof(peer));
+    peer.sin_family = AF_INET;
+    peer.sin_port = htons(port);
+    if (inet_aton(ip, &peer.sin_addr) == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct sham_endpoint *ep = malloc(sizeof(*ep));
+    if (!ep) return NULL;
+    if (endpoint_open(ep, cfg, 0) < 0) {
+        free(ep);
+        return NULL;
+    }
+    struct sham_conn *c = conn_new(ep, &peer);
+    if (!c) {
+        endpoint_close(ep);
+        free(ep);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (ep->cfg.encrypt && aead_keygen(c->kx_priv, c->kx_pub) < 0) {
+        sham_close(c);
+        errno = EIO;
+        return NULL;
+    }
+
+    // Data queued before the handshake completes must fit a FEC segment
+    // or a sealed segment carrying our key share; seg_room() keeps the
+    // segment that rides in the SYN short enough for the options
+    if (ep->cfg.fec != SHAM_FEC_OFF) c->mss -= FEC_HDR_MAX;
+    if (ep->cfg.encrypt) c->mss -= AEAD_OVERHEAD + AEAD_SHARE_LEN;
+
+    if (ep->cfg.token.len == TOKEN_LEN && !ep->cfg.encrypt) {
+        // Give the application a moment to queue data for the SYN
+        c->coalesce_deadline = now_us(c->ep) + SHAM_COALESCE_US;
+    } else {
+        send_syn(c);
+        arm_rto(c, now_us(c->ep));
+        endpoint_flush(ep);
+    }
+    return c;
+}
+
+int sham_poll_fd(const struct sham_conn *c) {
+    return c->ep->fd;
+}
+
+int sham_timeout(const struct sham_conn *c) {
+    return endpoint_timeout(c->ep);
+}
+
+// Reads everything waiting on the socket and runs due timers. On a
+// listener's connection this services every connection of the listener.
+int sham_process(struct sham_conn *c) {
+    return endpoint_process(c->ep);
+}
+
+// Convenience for blocking callers: waits for input or the next timer (at
+// most timeout_ms, -1 for no limit) and processes it. Needs a backend whose
+// descriptor can be polled.
+int sham_wait(struct sham_conn *c, int timeout_ms) {
+    struct pollfd pfd = { .fd = c->ep->fd, .events = POLLIN };
+    int t = sham_timeout(c);
+    if (t < 0 || (timeout_ms >= 0 && timeout_ms < t)) t = timeout_ms;
+    if (poll(&pfd, 1, t) < 0 && errno != EINTR) return -1;
+    return sham_process(c);
+}
+
+size_t sham_send_space(const struct sham_conn *c) {
+    size_t segs = SHAM_SNDQ - c->sndq_count;
+    size_t budget = (c->mem.limit - c->mem.used) / sizeof(struct sham_pbuf);
+    if (c->mem.used > c->mem.limit) budget = 0;
+    if (budget < segs) segs = budget;
+    size_t space = segs * c->mss;
+    if (c->sndq_count > c->sndq_sent) {
+        space += seg_room(c, c->sndq_count - 1) - sndq_at(c, c->sndq_count - 1)->len;
+    }
+    return space;
+}
+
+// Appends to the send queue without transmitting; returns the bytes taken
+static size_t sndq_append(struct sham_conn *c, const char *p, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        struct sham_segment *seg = NULL;
+        // Top up the last segment while it has not gone out yet
+        if (c->sndq_count > c->sndq_sent &&
+            sndq_at(c, c->sndq_count - 1)->len < seg_room(c, c->sndq_count - 1)) {
+            seg = sndq_at(c, c->sndq_count - 1);
+        } else if (c->sndq_count < SHAM_SNDQ) {
+            // Each segment is built in the buffer it will be sent from
+            struct sham_pbuf *pb = pool_get(&c->ep->pool);
+            if (!pb) break;
+            if (pbuf_charge(pb, &c->mem) < 0) {
+                pbuf_unref(pb);
+                break;
+            }
+            seg = sndq_at(c, c->sndq_count++);
+            seg->seq = c->snd_end;
+            seg->len = 0;
+            seg->pb = pb;
+            seg->sacked = 0;
+            seg->retx = 0;
+        } else {
+            break;
+        }
+        size_t chunk = seg_room(c, c->sndq_count - 1) - seg->len;
+        if (chunk > len - done) chunk = len - done;
+        memcpy(seg_data(seg) + seg->len, p + done, chunk);
+        seg->len += chunk;
+        c->snd_end += chunk;
+        done += chunk;
+    }
+    return done;
+}
+
+// Queues the parts back to back, then transmits once, so a small record
+// split across buffers still leaves as one datagram
+ssize_t sham_send_parts(struct sham_conn *c, const struct iovec *iov, int n) {
+    if (c->state == SHAM_FAILED || c->state == SHAM_CLOSED || c->fin_queued) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    size_t done = 0, want = 0;
+    for (int i = 0; i < n; i++) {
+        want += iov[i].iov_len;
+        size_t took = sndq_append(c, iov[i].iov_base, iov[i].iov_len);
+        done += took;
+        if (took < iov[i].iov_len) break;
+    }
+
+    if (done == 0 && want > 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    transmit(c, 0);
+    endpoint_flush(c->ep);
+    return done;
+}
+
+// Queues up to 'len' bytes; returns how many were taken
+ssize_t sham_send(struct sham_conn *c, const void *buf, size_t len) {
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+    return sham_send_parts(c, &iov, 1);
+}
+
+static size_t rcv_copy(const struct sham_conn *c, char *buf, size_t len) {
+    size_t take = len < c->rcv_len ? len : c->rcv_len;
+    size_t first = SHAM_RCVBUF - c->rcv_head < take ? SHAM_RCVBUF - c->rcv_head : take;
+    memcpy(buf, c->rcvbuf + c->rcv_head, first);
+    memcpy(buf + first, c->rcvbuf, take - first);
+    return take;
+}
+
+// Returns bytes read, 0 once the peer has finished sending, or -1
+ssize_t sham_recv(struct sham_conn *c, void *buf, size_t len) {
+    ssize_t n = sham_peek(c, buf, len);
+    if (n <= 0) return n;
+
+    c->rcv_head = (c->rcv_head + n) % SHAM_RCVBUF;
+    c->rcv_len -= n;
+
+    // Let a stalled sender know the window has reopened. Only a small
+    // advertised window can stall it; with a larger one the data still in
+    // flight brings back ACKs that carry the new window.
+    if (c->rcv_adv < SHAM_RCVBUF / 2 && rcv_window(c) >= c->rcv_adv + PAYLOAD_SIZE) {
+        send_ack(c);
+        endpoint_flush(c->ep);
+    }
+    return n;
+}
+
+ssize_t sham_peek(struct sham_conn *c, void *buf, size_t len) {
+    if (c->rcv_len > 0) return rcv_copy(c, buf, len);
+    if (c->peer_fin) return 0;
+    errno = c->state == SHAM_FAILED ? ECONNRESET : EAGAIN;
+    return -1;
+}
+
+// Share of the socket's egress relative to the other connections on it
+int sham_set_weight(struct sham_conn *c, unsigned weight) {
+    if (weight == 0 || weight > SHAM_WEIGHT_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    c->weight = weight;
+    return 0;
+}
+
+// Sends a FIN once all queued data is out
+int sham_shutdown(struct sham_conn *c) {
+    if (c->fin_queued) return 0;
+    if (c->state == SHAM_FAILED || c->state == SHAM_CLOSED) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    c->fin_queued = 1;
+    if (c->state == SHAM_ESTABLISHED) c->state = SHAM_CLOSING;
+    transmit(c, 1);
+    endpoint_flush(c->ep);
+    return 0;
+}
+
+void sham_close(struct sham_conn *c) {
+    struct sham_endpoint *ep = c->ep;
+    conn_discard(c);
+
+    if (!ep->listening) {
+        endpoint_close(ep);
+        free(ep);
+    }
+}
+
+enum sham_state sham_conn_state(const struct sham_conn *c) {
+    return c->state;
+}
+
+uint8_t sham_conn_codec(const struct sham_conn *c) {
+    return c->codec;
+}
+
+uint8_t sham_conn_fec(const struct sham_conn *c) {
+    return c->fec_mode;
+}
+
+int sham_conn_encrypted(const struct sham_conn *c) {
+    return c->aead != NULL;
+}
+
+const struct sockaddr_in *sham_conn_peer(const struct sham_conn *c) {
+    return &c->peer;
+}
+
+void sham_conn_stats(const struct sham_conn *c, struct sham_stats *stats) {
+    stats->mem_used = c->mem.used;
+    stats->mem_peak = c->mem.peak;
+    stats->mem_limit = c->mem.limit;
+    stats->segments_sent = c->segments_sent;
+    stats->retransmits = c->retransmits;
+    stats->fec_recovered = c->fec_recovered;
+    stats->tail_probes = c->tail_probes;
+    stats->srtt_us = (uint32_t)c->srtt_us;
+}
+
+// The token the server issued on this connection, for the next connect
+int sham_conn_token(const struct sham_conn *c, struct sham_token *token) {
+    if (c->token.len == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    *token = c->token;
+    return 0;
+}
@@ -25,6 +25,18 @@
 #define SYN 0x1
 #define ACK 0x2
 #define FIN 0x4
+#define FEC 0x8    // Parity segment (fec.h), not part of the byte stream
+#define LOSS 0x10  // ACK carrying a receiver loss report: [lost u16][expected u16]
+#define SACK 0x20  // ACK carrying [n u8] and n [start u32][end u32] blocks held out of order,
+                   // after the loss report if there is one
+#define KEY 0x40   // Sealed packet carrying the client's key share (aead.h)
+
+// File transfer framing used by the client and server programs. An
+// upload is [name\0][file]; a download request is [FILE_REQ_GET][name\0],
+// answered with [status u8] and the file. Both ends then send FIN.
+#define FILE_REQ_GET 0x01
+#define FILE_GET_OK 0
+#define FILE_GET_NOT_FOUND 1
 
 // S.H.A.M. Header Structure
 struct sham_header {
@@ -40,44 +52,119 @@ struct sham_packet {
     char data[PAYLOAD_SIZE];
 };
 
-// --- Logging ---
-FILE* log_file = NULL;
-
-void log_event(const char* format, ...) {
-    if (log_file == NULL) return;
-
-    char time_buffer[30];
-    struct timeval tv;
-    time_t curtime;
+// --- Logging (log.c) ---
+extern FILE* log_file;
+
+void log_event(const char* format, ...);
+void init_logging(const char* filename);
+void close_logging();
+
+// --- Library API (sham.c, built as libsham.a) ---
+// Every call is non-blocking. Put sham_poll_fd() / sham_listener_fd() in
+// your poll or epoll set (level-triggered), wake up after at most
+// sham_timeout() ms, and call sham_process() whenever either happens.
+// Calls that cannot make progress fail with errno set to EAGAIN.
+
+// Resumption token issued by a server; opaque to the application
+#define SHAM_TOKEN_MAX 32
+#define SHAM_KEY_LEN 32      // Listener key that signs cookies and tokens
+#define SHAM_PSK_MAX 64
+struct sham_token {
+    uint8_t len;          // 0 for none
+    uint8_t data[SHAM_TOKEN_MAX];
+};
 
-    gettimeofday(&tv, NULL);
-    curtime = tv.tv_sec;
+// Clocks and datagram operations under an endpoint. The default,
+// sham_udp_io, is a UDP socket, CLOCK_MONOTONIC and CLOCK_REALTIME;
+// another backend (a simulated network, say) supplies its own and passes
+// it in cfg.io.
+struct sham_datagram {
+    void *data;
+    size_t len;           // Send: datagram length. Receive: buffer size in, bytes received out
+    struct sockaddr_in *addr; // Destination, or filled in with the sender
+};
 
-    strftime(time_buffer, 30, "%Y-%m-%d %H:%M:%S", localtime(&curtime));
-    fprintf(log_file, "[%s.%06ld] [LOG] ", time_buffer, tv.tv_usec);
+struct sham_io {
+    void *ctx;            // Passed to every call
+    long long (*now_us)(void *ctx);
+    long long (*wall_us)(void *ctx); // For cookies and tokens, which outlive the process; NULL for now_us
+    int (*open)(void *ctx, uint16_t port);   // Descriptor bound to port (0 for any), or -1
+    void (*close)(void *ctx, int fd);
+    // Move up to n datagrams; return how many, or -1 with errno (EAGAIN
+    // when nothing is waiting)
+    int (*send)(void *ctx, int fd, struct sham_datagram *d, int n);
+    int (*recv)(void *ctx, int fd, struct sham_datagram *d, int n);
+};
 
-    va_list args;
-    va_start(args, format);
-    vfprintf(log_file, format, args);
-    va_end(args);
+extern const struct sham_io sham_udp_io;
+
+struct sham_config {
+    uint8_t codecs;       // Compression codecs offered (client) or accepted (server)
+    uint8_t fec;          // SHAM_FEC_* mode requested (client) or highest accepted (server)
+    uint8_t fec_k;        // Data segments per parity group, 0 for FEC_DEFAULT_K
+    uint8_t fec_m;        // Reed-Solomon parity segments per group, 0 to adapt to loss
+    double loss_rate;     // Simulated drop rate for incoming data segments
+    size_t mem_limit;     // Packet buffer bytes one connection may hold, 0 for 1 MB
+    struct sham_token token; // Client: token from an earlier connection, enables 0-RTT
+    const uint8_t *key;   // Listener: SHAM_KEY_LEN-byte key, NULL for a random one
+    uint64_t rate;        // Egress pacing for the socket in bytes per second, 0 for none
+    uint8_t encrypt;      // Client: require AEAD. Listener: accept it
+    const uint8_t *psk;   // Optional pre-shared key mixed into the session keys;
+    size_t psk_len;       // a listener with one refuses unencrypted clients
+    const struct sham_io *io; // NULL for sham_udp_io
+};
 
-    fflush(log_file);
-}
+struct sham_stats {
+    size_t mem_used;      // Packet buffer bytes held right now
+    size_t mem_peak;
+    size_t mem_limit;
+    uint64_t segments_sent;
+    uint64_t retransmits;
+    uint64_t fec_recovered;
+    uint64_t tail_probes;
+    uint32_t srtt_us;     // Smoothed round-trip time, 0 before the first sample
+};
 
-void init_logging(const char* filename) {
-    if (getenv("RUDP_LOG") != NULL && strcmp(getenv("RUDP_LOG"), "1") == 0) {
-        log_file = fopen(filename, "w");
-        if (log_file == NULL) {
-            perror("fopen log file");
-        }
-    }
-}
+enum sham_state {
+    SHAM_CONNECTING,
+    SHAM_ESTABLISHED,
+    SHAM_CLOSING,         // sham_shutdown() called, FINs not yet exchanged
+    SHAM_CLOSED,
+    SHAM_FAILED           // Peer stopped answering
+};
 
-void close_logging() {
-    if (log_file != NULL) {
-        fclose(log_file);
-    }
-}
+struct sham_listener;
+struct sham_conn;
+
+void sham_config_init(struct sham_config *cfg);
+
+struct sham_listener *sham_listen(uint16_t port, const struct sham_config *cfg);
+struct sham_conn *sham_accept(struct sham_listener *l);
+int sham_listener_fd(const struct sham_listener *l);
+int sham_listener_timeout(const struct sham_listener *l);
+int sham_listener_process(struct sham_listener *l);
+void sham_listener_close(struct sham_listener *l);
+
+struct sham_conn *sham_connect(const char *ip, uint16_t port, const struct sham_config *cfg);
+int sham_poll_fd(const struct sham_conn *c);
+int sham_timeout(const struct sham_conn *c);
+int sham_process(struct sham_conn *c);
+int sham_wait(struct sham_conn *c, int timeout_ms);
+ssize_t sham_send(struct sham_conn *c, const void *buf, size_t len);
+ssize_t sham_recv(struct sham_conn *c, void *buf, size_t len);
+ssize_t sham_peek(struct sham_conn *c, void *buf, size_t len);
+size_t sham_send_space(const struct sham_conn *c);
+int sham_shutdown(struct sham_conn *c);
+int sham_set_weight(struct sham_conn *c, unsigned weight);
+void sham_close(struct sham_conn *c);
+
+enum sham_state sham_conn_state(const struct sham_conn *c);
+uint8_t sham_conn_codec(const struct sham_conn *c);
+uint8_t sham_conn_fec(const struct sham_conn *c);
+int sham_conn_encrypted(const struct sham_conn *c);
+const struct sockaddr_in *sham_conn_peer(const struct sham_conn *c);
+void sham_conn_stats(const struct sham_conn *c, struct sham_stats *stats);
+int sham_conn_token(const struct sham_conn *c, struct sham_token *token);
 
 #endif // SHAM_H
 
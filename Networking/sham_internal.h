@@ -0,0 +1,208 @@
+#ifndef SHAM_INTERNAL_H
+#define SHAM_INTERNAL_H
+
+#include "sham.h"
+#include "fec.h"
+#include "pool.h"
+#include "cookie.h"
+#include "aead.h"
+
+// Library internals shared by sham.c and the message helpers
+
+#define SHAM_SNDQ 256            // Segments queued per connection (in flight + unsent)
+#define SHAM_OOO_SLOTS 64        // Out-of-order segments held by the receiver
+#define SHAM_RCVBUF BUFFER_SIZE
+#define SHAM_COALESCE_US 5000    // Longest a partial segment waits for company
+#define SHAM_MAX_RETRIES 10      // Consecutive timeouts before the peer is declared gone
+#define SHAM_SACK_MAX 4          // SACK blocks per ACK
+#define SHAM_TLP_MIN_US 10000    // Floor for the tail loss probe timeout
+#define SHAM_REO_MIN_US 1000     // Floor for the RACK reordering window
+#define FEC_HISTORY 64           // Recently received segments kept for FEC decoding
+#define FEC_PARITY_SLOTS 32      // Parity segments waiting for their group
+#define SHAM_BATCH 32            // Datagrams per sendmmsg / recvmmsg
+#define SHAM_MEM_LIMIT (1 << 20) // Default per-connection packet buffer budget
+#define SHAM_SYN_OPTS_MAX 40     // SYN option bytes ahead of 0-RTT data
+#define SHAM_SYN_ACK_OPTS_MAX 96
+#define SHAM_OPT_END 0           // Ends the SYN options when data follows
+#define SHAM_QUANTUM PAYLOAD_SIZE // Scheduler bytes per turn per unit of weight
+#define SHAM_WEIGHT_MAX 64
+#define SHAM_PACE_BURST (SHAM_BATCH * PAYLOAD_SIZE) // Pacing bucket depth
+#define SHAM_UNVERIFIED_MAX 32   // Token connections waiting for the peer's first ACK
+#define SHAM_HANDSHAKE_US (SHAM_MAX_RETRIES * RTO_MS * 1000LL) // How long they wait for it
+#define SHAM_IDLE_US 60000000LL  // Silence after which a listener drops a connection
+#define SHAM_KEEPALIVE_US 15000000LL // A client's bare ACK interval
+
+struct sham_segment {
+    uint32_t seq;
+    uint16_t len;
+    long long xmit_us;           // Last (re)transmission
+    struct sham_pbuf *pb;        // Payload in pb->pkt.data, NULL for a free slot
+    uint8_t sacked;              // Peer holds it out of order
+    uint8_t retx;                // Retransmitted; no RTT samples from it
+};
+
+// Sender's open parity group; parity rows are accumulated as each data
+// segment goes out for the first time.
+struct sham_fec_tx {
+    uint32_t base;               // Sequence number of the first member
+    int count;
+    int m;
+    uint16_t lens[FEC_MAX_K];
+    uint16_t max_len;
+    uint8_t parity[FEC_MAX_M][PAYLOAD_SIZE];
+};
+
+// A received parity segment, kept in the buffer it arrived in
+struct sham_fec_parity {
+    struct sham_pbuf *pb;        // NULL for a free slot
+    uint32_t base;
+    uint8_t k;
+    uint8_t index;
+    uint16_t lens[FEC_MAX_K];
+    uint16_t off;                // Parity bytes start at pb->pkt.data + off
+    uint16_t len;
+};
+
+struct sham_fec_rx {
+    struct sham_segment history[FEC_HISTORY];
+    unsigned history_next;
+    struct sham_fec_parity parity[FEC_PARITY_SLOTS];
+    unsigned parity_next;
+    uint32_t counted_base;       // Last group included in the loss report
+    int counted_any;
+    uint16_t lost;               // Loss report not yet sent
+    uint16_t expected;
+};
+
+struct sham_endpoint;
+
+struct sham_conn {
+    struct sham_endpoint *ep;
+    struct sham_conn *next;      // Endpoint's connection list
+    struct sockaddr_in peer;
+    enum sham_state state;
+    int passive;                 // Created by a listener
+    int accepted;
+    int verified;                // Passive: the peer has acknowledged our SYN-ACK
+    long long idle_deadline;     // Passive: when to give up on a silent peer; active: next keepalive
+    struct sham_mem mem;         // Packet buffers held by this connection
+    uint64_t segments_sent;
+    uint64_t retransmits;
+    uint64_t tail_probes;
+    uint64_t fec_recovered;
+    uint8_t codec;
+
+    // Send scheduler (see struct sham_endpoint)
+    struct sham_conn *sched_next;
+    int sched_active;
+    int force_send;              // Send a partial segment without waiting
+    unsigned weight;
+    size_t deficit;
+
+    uint32_t iss;
+    uint16_t mss;                // Payload bytes per data segment
+    int syn_sent;
+    uint16_t early_len;          // 0-RTT bytes carried by our SYN
+    struct sham_token token;     // Issued by the server in its SYN-ACK
+
+    // Encryption, once keys are agreed. kx_pub is our X25519 public key;
+    // the client keeps its private key only until the SYN-ACK arrives.
+    struct aead *aead;
+    uint8_t kx_priv[AEAD_SHARE_LEN];
+    uint8_t kx_pub[AEAD_SHARE_LEN];
+    int key_acked;               // Client: the server has our key share
+
+    // Forward error correction, as negotiated
+    uint8_t fec_mode;
+    uint8_t fec_k;
+    uint8_t fec_m;
+    double fec_loss;             // Loss rate reported by the peer
+    struct sham_fec_tx *fec_tx;
+    struct sham_fec_rx *fec_rx;
+
+    // Sender. sndq is a ring of segments starting at snd_una; the first
+    // sndq_sent of them have been transmitted.
+    uint32_t snd_una;
+    uint32_t snd_nxt;
+    uint32_t snd_end;            // Sequence number after the last queued byte
+    uint32_t peer_window;
+    struct sham_segment *sndq;
+    unsigned sndq_head;
+    unsigned sndq_count;
+    unsigned sndq_sent;
+    long long rto_deadline;      // 0 when nothing is outstanding
+    long long coalesce_deadline; // 0 when nothing is held back
+    int retries;
+
+    // Time-based loss detection (RACK) and tail loss probes. A segment is
+    // lost once a segment sent after it has been delivered and a
+    // reordering window has passed; a probe goes out after 2 * SRTT
+    // without an ACK so that tail losses get the same treatment.
+    long long srtt_us;           // 0 before the first sample
+    long long rttvar_us;
+    long long min_rtt_us;
+    long long syn_xmit_us;
+    long long rack_xmit_us;      // Send time of the latest delivered segment
+    long long rack_rtt_us;       // Its round-trip time
+    long long rack_deadline;     // 0 when no segment is waiting out the window
+    long long tlp_deadline;      // 0 when no probe is scheduled
+    int tlp_out;                 // Probe sent, no ACK progress since
+    int fin_queued;
+    int fin_sent;
+    int fin_acked;
+
+    // Receiver. rcvbuf is a byte ring of in-order data the application
+    // has not read yet; ooo holds segments that arrived early.
+    uint32_t rcv_nxt;
+    char *rcvbuf;
+    size_t rcv_head;
+    size_t rcv_len;
+    struct sham_segment *ooo;
+    int peer_fin;
+    int ack_pending;
+    uint16_t rcv_adv;            // Window in the last packet we sent
+};
+
+// A UDP socket and the connections multiplexed over it. A listener owns
+// one shared endpoint; every client connection owns a private one.
+// Outgoing datagrams collect in tx and leave in one sendmmsg call; the
+// batch holds a reference, so a segment can be queued for retransmission
+// and sitting in the batch at the same time.
+//
+// New data goes out by deficit round robin over the connections that have
+// something to send: each turn a connection may send SHAM_QUANTUM * weight
+// bytes, so one bulk transfer cannot starve short ones. With cfg.rate set,
+// every datagram also spends tokens from a bucket refilled at that rate.
+struct sham_endpoint {
+    const struct sham_io *io;
+    int fd;
+    int listening;
+    struct sham_config cfg;
+    struct sham_conn *conns;
+    struct sham_conn *sched_head; // Connections with data ready, in turn order
+    struct sham_conn *sched_tail;
+    long long tokens;            // Pacing bucket in bytes, may go negative
+    long long tokens_us;
+    long long pace_deadline;     // 0 unless waiting for tokens
+    uint8_t key[COOKIE_KEY_LEN]; // Listener's cookie and token key
+    uint8_t kx_secret[2][COOKIE_KEY_LEN]; // Handshake key pair secrets of kx_slot and the slot before
+    uint32_t kx_slot;
+    struct token_cache *token_cache; // Listener only
+    int unverified;              // Passive connections not yet verified
+    struct sham_pool pool;
+    struct sham_pbuf *tx[SHAM_BATCH];
+    struct sockaddr_in tx_to[SHAM_BATCH];
+    struct sham_conn *tx_conn[SHAM_BATCH]; // Sealing keys, NULL for none
+    struct sham_packet sealed[SHAM_BATCH]; // Encrypted copies of the batch
+    int ntx;
+    struct sham_pbuf *rx[SHAM_BATCH];
+};
+
+struct sham_listener {
+    struct sham_endpoint ep;
+};
+
+long long sham_now_us(void);
+ssize_t sham_send_parts(struct sham_conn *c, const struct iovec *iov, int n);
+
+#endif // SHAM_INTERNAL_H
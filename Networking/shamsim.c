@@ -0,0 +1,465 @@
+#include "sham.h"
+#include "fec.h"
+#include <errno.h>
+#include <math.h>
+
+// Deterministic simulator: a sender and a receiver in one process, talking
+// through libsham over a simulated network on a virtual clock. Time only
+// moves when nothing is due, so a run costs the work it does rather than
+// the time the transfer would take. The same seed gives the same run.
+
+void die(const char *s) {
+    perror(s);
+    exit(1);
+}
+
+// --- Simulated network ---
+// Every endpoint is a node at 127.0.0.1:<port>. A datagram to a node
+// crosses that node's inbound link: random loss, then a drop-tail queue
+// drained at the link rate, then a fixed propagation delay. Both
+// directions share the same parameters.
+
+#define SIM_NODES 4
+#define SIM_SLOTS 4096           // Datagrams a link can hold in flight
+#define SIM_PORT 5000
+#define SIM_START_US 1000000LL   // Deadlines use 0 for none, so time starts above it
+
+struct sim_params {
+    double delay_ms;             // One way
+    double rate_mbit;            // 0 for unlimited
+    double loss;
+    double burst;                // Mean length of a loss burst, in datagrams
+    int queue;                   // Bottleneck queue in full-size datagrams
+};
+
+struct sim_packet {
+    long long arrive_us;
+    uint16_t from_port;
+    size_t len;
+    char data[sizeof(struct sham_packet)];
+};
+
+struct sim_link {
+    struct sim_packet *q;        // Ring in arrival order
+    unsigned head;
+    unsigned count;
+    double busy_until;           // When the link has serialised all it holds
+    int in_burst;
+};
+
+struct sim_node {
+    int used;
+    uint16_t port;
+    struct sim_link in;
+};
+
+struct sim_net {
+    struct sim_params p;
+    long long now;
+    uint64_t rng;
+    uint16_t next_port;
+    struct sim_node nodes[SIM_NODES];
+    uint64_t datagrams;
+    uint64_t lost;               // Random loss
+    uint64_t overflow;           // Queue full
+};
+
+// xorshift64*, kept apart from rand() which the library uses
+static double sim_random(struct sim_net *net) {
+    net->rng ^= net->rng >> 12;
+    net->rng ^= net->rng << 25;
+    net->rng ^= net->rng >> 27;
+    return (double)((net->rng * 2685821657736338717ULL) >> 11) / (double)(1ULL << 53);
+}
+
+// Gilbert model: a burst starts with a probability that gives the
+// configured average loss and ends with probability 1 / burst
+static int sim_drop(struct sim_net *net, struct sim_link *l) {
+    double loss = net->p.loss, burst = net->p.burst;
+    if (loss <= 0) return 0;
+    if (burst <= 1 || loss >= 1) return sim_random(net) < loss;
+    if (l->in_burst) l->in_burst = sim_random(net) >= 1 / burst;
+    else l->in_burst = sim_random(net) < loss / (burst * (1 - loss));
+    return l->in_burst;
+}
+
+static void sim_deliver(struct sim_net *net, struct sim_link *l, uint16_t from, const void *data, size_t len) {
+    net->datagrams++;
+    if (sim_drop(net, l)) {
+        net->lost++;
+        return;
+    }
+
+    double start = l->busy_until > net->now ? l->busy_until : net->now;
+    double tx_us = 0;
+    if (net->p.rate_mbit > 0) {
+        double backlog = (start - net->now) * net->p.rate_mbit / 8;
+        if (backlog + len > (double)net->p.queue * sizeof(struct sham_packet)) {
+            net->overflow++;
+            return;
+        }
+        tx_us = len * 8 / net->p.rate_mbit;
+    }
+    if (l->count == SIM_SLOTS) {
+        net->overflow++;
+        return;
+    }
+    l->busy_until = start + tx_us;
+
+    struct sim_packet *sp = &l->q[(l->head + l->count++) % SIM_SLOTS];
+    sp->arrive_us = (long long)ceil(l->busy_until + net->p.delay_ms * 1000);
+    sp->from_port = from;
+    sp->len = len;
+    memcpy(sp->data, data, len);
+}
+
+// Earliest arrival still on a link, or -1
+static long long sim_next(const struct sim_net *net) {
+    long long next = -1;
+    for (int i = 0; i < SIM_NODES; i++) {
+        const struct sim_link *l = &net->nodes[i].in;
+        if (!net->nodes[i].used || l->count == 0) continue;
+        long long at = l->q[l->head].arrive_us;
+        if (next < 0 || at < next) next = at;
+    }
+    return next;
+}
+
+// --- Backend ops ---
+
+static long long sim_now(void *ctx) {
+    return ((struct sim_net *)ctx)->now;
+}
+
+static int sim_open(void *ctx, uint16_t port) {
+    struct sim_net *net = ctx;
+    if (port == 0) port = net->next_port++;
+    int fd = -1;
+    for (int i = 0; i < SIM_NODES; i++) {
+        if (net->nodes[i].used && net->nodes[i].port == port) {
+            errno = EADDRINUSE;
+            return -1;
+        }
+        if (!net->nodes[i].used && fd < 0) fd = i;
+    }
+    if (fd < 0) {
+        errno = EMFILE;
+        return -1;
+    }
+    struct sim_node *n = &net->nodes[fd];
+    memset(n, 0, sizeof(*n));
+    n->in.q = malloc(SIM_SLOTS * sizeof(struct sim_packet));
+    if (!n->in.q) {
+        errno = ENOMEM;
+        return -1;
+    }
+    n->used = 1;
+    n->port = port;
+    return fd;
+}
+
+static void sim_close(void *ctx, int fd) {
+    struct sim_net *net = ctx;
+    free(net->nodes[fd].in.q);
+    memset(&net->nodes[fd], 0, sizeof(net->nodes[fd]));
+}
+
+// Datagrams to a port nobody holds vanish, as they would over UDP
+static int sim_send(void *ctx, int fd, struct sham_datagram *d, int n) {
+    struct sim_net *net = ctx;
+    for (int i = 0; i < n; i++) {
+        uint16_t port = ntohs(d[i].addr->sin_port);
+        for (int j = 0; j < SIM_NODES; j++) {
+            if (net->nodes[j].used && net->nodes[j].port == port) {
+                sim_deliver(net, &net->nodes[j].in, net->nodes[fd].port, d[i].data, d[i].len);
+                break;
+            }
+        }
+    }
+    return n;
+}
+
+static int sim_recv(void *ctx, int fd, struct sham_datagram *d, int n) {
+    struct sim_net *net = ctx;
+    struct sim_link *l = &net->nodes[fd].in;
+    int r = 0;
+    while (r < n && l->count > 0 && l->q[l->head].arrive_us <= net->now) {
+        struct sim_packet *sp = &l->q[l->head];
+        size_t len = sp->len < d[r].len ? sp->len : d[r].len;
+        memcpy(d[r].data, sp->data, len);
+        d[r].len = len;
+        memset(d[r].addr, 0, sizeof(*d[r].addr));
+        d[r].addr->sin_family = AF_INET;
+        d[r].addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        d[r].addr->sin_port = htons(sp->from_port);
+        l->head = (l->head + 1) % SIM_SLOTS;
+        l->count--;
+        r++;
+    }
+    if (r == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return r;
+}
+
+// --- One transfer ---
+
+struct sim_opts {
+    struct sim_params net;
+    size_t size;
+    double limit_s;              // Simulated time before a run is abandoned
+    uint8_t fec;
+    uint8_t fec_k;
+    uint8_t fec_m;
+    uint8_t encrypt;
+    uint8_t resume;              // Measure a connection that presents a token
+};
+
+struct sim_result {
+    int ok;
+    long long elapsed_us;
+    long long fresh_us;          // With resume: the same transfer without a token
+    struct sham_stats tx;        // Sender
+    struct sham_stats rx;        // Receiver
+    uint64_t datagrams;
+    uint64_t dropped;
+};
+
+static uint8_t pattern(size_t off) {
+    return (uint8_t)(off % 251);
+}
+
+// Uploads opts->size bytes on a new connection and reports when the
+// receiver has read them all and the FIN. Leaves the token the listener
+// issued in *token.
+static void sim_transfer(struct sim_net *net, struct sham_listener *l, const struct sham_config *cfg,
+                         const struct sim_opts *opts, struct sim_result *res, struct sham_token *token) {
+    struct sham_conn *conn = sham_connect("127.0.0.1", SIM_PORT, cfg);
+    if (!conn) die("sham_connect");
+
+    struct sham_conn *peer = NULL;
+    char buf[16384];
+    size_t sent = 0, received = 0;
+    int shut = 0, eof = 0, corrupt = 0, idle = 0;
+    long long start = net->now;
+    long long limit = net->now + (long long)(opts->limit_s * 1e6);
+
+    memset(res, 0, sizeof(*res));
+    while (!eof && net->now < limit) {
+        sham_process(conn);
+        sham_listener_process(l);
+        if (sham_conn_state(conn) == SHAM_FAILED) break;
+
+        while (sent < opts->size && sham_send_space(conn) > 0) {
+            size_t n = opts->size - sent < sizeof(buf) ? opts->size - sent : sizeof(buf);
+            if (n > sham_send_space(conn)) n = sham_send_space(conn);
+            for (size_t i = 0; i < n; i++) buf[i] = pattern(sent + i);
+            ssize_t r = sham_send(conn, buf, n);
+            if (r < 0) break;
+            sent += r;
+        }
+        if (sent == opts->size && !shut) {
+            sham_shutdown(conn);
+            shut = 1;
+        }
+
+        if (!peer) peer = sham_accept(l);
+        while (peer) {
+            ssize_t r = sham_recv(peer, buf, sizeof(buf));
+            if (r <= 0) {
+                eof = r == 0;
+                break;
+            }
+            for (ssize_t i = 0; i < r; i++) {
+                if ((uint8_t)buf[i] != pattern(received + i)) corrupt = 1;
+            }
+            received += r;
+        }
+        if (eof) break;
+
+        // Jump to the next arrival or timer
+        long long next = sim_next(net);
+        int waits[2] = { sham_timeout(conn), sham_listener_timeout(l) };
+        for (int i = 0; i < 2; i++) {
+            if (waits[i] < 0) continue;
+            long long at = net->now + (waits[i] > 0 ? waits[i] * 1000LL : 1);
+            if (next < 0 || at < next) next = at;
+        }
+        if (next < 0) break; // Nothing in flight and no timers: stuck
+        if (next > net->now) {
+            net->now = next;
+            idle = 0;
+        } else if (++idle > 1000000) {
+            fprintf(stderr, "Simulation stalled at %lld us\n", net->now - SIM_START_US);
+            exit(1);
+        }
+    }
+
+    res->ok = eof && !corrupt && received == opts->size;
+    res->elapsed_us = net->now - start;
+    sham_conn_stats(conn, &res->tx);
+    if (peer) sham_conn_stats(peer, &res->rx);
+    if (sham_conn_token(conn, token) < 0) token->len = 0;
+
+    sham_close(conn);
+    if (peer) sham_close(peer);
+}
+
+// One run. With opts->resume a first connection fetches a resumption
+// token and the measured one presents it. On a lossless link the run fails
+// if that makes it slower than the first by more than one full datagram,
+// which covers the token's own bytes in the SYN; with loss the two see
+// different drops and only the times are reported.
+static void sim_run(const struct sim_opts *opts, uint64_t seed, struct sim_result *res) {
+    struct sim_net net;
+    memset(&net, 0, sizeof(net));
+    net.p = opts->net;
+    net.now = SIM_START_US;
+    net.rng = seed * 0x9E3779B97F4A7C15ULL + 1;
+    net.next_port = 40000;
+    srand((unsigned)seed);
+
+    struct sham_io io = sham_udp_io;
+    io.ctx = &net;
+    io.now_us = sim_now;
+    io.wall_us = NULL; // Cookies and tokens run on simulated time too
+    io.open = sim_open;
+    io.close = sim_close;
+    io.send = sim_send;
+    io.recv = sim_recv;
+
+    struct sham_config cfg;
+    sham_config_init(&cfg);
+    cfg.io = &io;
+    cfg.fec = SHAM_FEC_RS;
+    cfg.encrypt = 1;
+    struct sham_listener *l = sham_listen(SIM_PORT, &cfg);
+    if (!l) die("sham_listen");
+
+    cfg.fec = opts->fec;
+    cfg.fec_k = opts->fec_k;
+    cfg.fec_m = opts->fec_m;
+    cfg.encrypt = opts->encrypt;
+    struct sham_token token;
+    struct sim_result first;
+    if (opts->resume) {
+        sim_transfer(&net, l, &cfg, opts, &first, &token);
+        if (!first.ok || token.len == 0) {
+            *res = first;
+            res->ok = 0;
+            sham_listener_close(l);
+            return;
+        }
+        cfg.token = token;
+        net.rng = seed * 0x9E3779B97F4A7C15ULL + 1; // Same loss draws as the first
+    }
+    sim_transfer(&net, l, &cfg, opts, res, &token);
+    if (opts->resume) {
+        res->fresh_us = first.elapsed_us;
+        double slack_us = opts->net.rate_mbit > 0 ? sizeof(struct sham_packet) * 8 / opts->net.rate_mbit : 0;
+        if (opts->net.loss <= 0 && res->elapsed_us > first.elapsed_us + slack_us) res->ok = 0;
+    }
+    res->datagrams = net.datagrams;
+    res->dropped = net.lost + net.overflow;
+
+    sham_listener_close(l);
+}
+
+// --- Main ---
+
+static double wall_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--size=<KB>] [--delay=<ms>] [--bw=<Mbit/s>] [--loss=<rate>] [--burst=<packets>] "
+                    "[--queue=<packets>] [--fec=xor|rs[:k[:m]]] [--encrypt] [--resume] [--seed=<n>] [--runs=<n>] [--limit=<s>] "
+                    "[--quiet]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    struct sim_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.size = 1024 * 1024;
+    opts.net.delay_ms = 10;
+    opts.net.rate_mbit = 10;
+    opts.net.burst = 1;
+    opts.net.queue = 64;
+    opts.limit_s = 600;
+    uint64_t seed = 1;
+    int runs = 1, quiet = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        if (strncmp(a, "--size=", 7) == 0) opts.size = (size_t)(atof(a + 7) * 1024);
+        else if (strncmp(a, "--delay=", 8) == 0) opts.net.delay_ms = atof(a + 8);
+        else if (strncmp(a, "--bw=", 5) == 0) opts.net.rate_mbit = atof(a + 5);
+        else if (strncmp(a, "--loss=", 7) == 0) opts.net.loss = atof(a + 7);
+        else if (strncmp(a, "--burst=", 8) == 0) opts.net.burst = atof(a + 8);
+        else if (strncmp(a, "--queue=", 8) == 0) opts.net.queue = atoi(a + 8);
+        else if (strncmp(a, "--seed=", 7) == 0) seed = strtoull(a + 7, NULL, 10);
+        else if (strncmp(a, "--runs=", 7) == 0) runs = atoi(a + 7);
+        else if (strncmp(a, "--limit=", 8) == 0) opts.limit_s = atof(a + 8);
+        else if (strcmp(a, "--encrypt") == 0) opts.encrypt = 1;
+        else if (strcmp(a, "--resume") == 0) opts.resume = 1;
+        else if (strcmp(a, "--quiet") == 0) quiet = 1;
+        else if (strncmp(a, "--fec=", 6) == 0) {
+            // --fec=xor[:k] or --fec=rs[:k[:m]]
+            const char *spec = a + 6;
+            int k = 0, m = 0;
+            if (strncmp(spec, "xor", 3) == 0) opts.fec = SHAM_FEC_XOR;
+            else if (strncmp(spec, "rs", 2) == 0) opts.fec = SHAM_FEC_RS;
+            else usage(argv[0]);
+            const char *colon = strchr(spec, ':');
+            if (colon) sscanf(colon + 1, "%d:%d", &k, &m);
+            opts.fec_k = (uint8_t)k;
+            opts.fec_m = (uint8_t)m;
+        } else usage(argv[0]);
+    }
+    if (runs < 1 || opts.net.loss < 0 || opts.net.loss >= 1 || opts.net.queue < 1) usage(argv[0]);
+
+    printf("Link: %.1f ms one way, %s%.1f Mbit/s, loss %.3f (burst %.1f), queue %d; %zu KB per run\n",
+           opts.net.delay_ms, opts.net.rate_mbit > 0 ? "" : "unlimited ", opts.net.rate_mbit, opts.net.loss,
+           opts.net.burst, opts.net.queue, opts.size / 1024);
+
+    int ok = 0;
+    double sum_goodput = 0, min_goodput = 0, max_goodput = 0, sum_retx = 0, sim_s = 0;
+    double start = wall_s();
+    for (int r = 0; r < runs; r++) {
+        struct sim_result res;
+        sim_run(&opts, seed + r, &res);
+        sim_s += res.elapsed_us / 1e6;
+
+        double goodput = res.elapsed_us > 0 ? opts.size * 8.0 / res.elapsed_us : 0; // Mbit/s
+        double retx = res.tx.segments_sent ? 100.0 * res.tx.retransmits / res.tx.segments_sent : 0;
+        if (!quiet) {
+            printf("seed %llu: %s %.3f s, goodput %.2f Mbit/s, sent %llu, retx %llu (%.1f%%), tlp %llu, "
+                   "fec %llu, srtt %.1f ms, dropped %llu/%llu\n",
+                   (unsigned long long)(seed + r), res.ok ? "done" : "FAILED", res.elapsed_us / 1e6, goodput,
+                   (unsigned long long)res.tx.segments_sent, (unsigned long long)res.tx.retransmits, retx,
+                   (unsigned long long)res.tx.tail_probes, (unsigned long long)res.rx.fec_recovered,
+                   res.tx.srtt_us / 1000.0, (unsigned long long)res.dropped, (unsigned long long)res.datagrams);
+            if (opts.resume) printf("  without a token: %.3f s\n", res.fresh_us / 1e6);
+        }
+        if (!res.ok) continue;
+        if (ok == 0 || goodput < min_goodput) min_goodput = goodput;
+        if (ok == 0 || goodput > max_goodput) max_goodput = goodput;
+        sum_goodput += goodput;
+        sum_retx += retx;
+        ok++;
+    }
+    double wall = wall_s() - start;
+
+    printf("Runs: %d of %d completed\n", ok, runs);
+    if (ok > 0) {
+        printf("Goodput: mean %.2f, min %.2f, max %.2f Mbit/s\n", sum_goodput / ok, min_goodput, max_goodput);
+        printf("Retransmitted: %.2f%% of segments sent\n", sum_retx / ok);
+    }
+    // Real time varies from run to run; keep stdout reproducible
+    fprintf(stderr, "Simulated %.1f s in %.2f s (%.0fx real time)\n", sim_s, wall, wall > 0 ? sim_s / wall : 0);
+    return ok == runs ? 0 : 1;
+}
@@ -0,0 +1,555 @@
+#define _GNU_SOURCE
+#include "xdp.h"
+#include <errno.h>
+#include <stddef.h>
+#include <net/if.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+#define XDP_FRAME_SIZE 2048
+#define XDP_FRAMES 4096          // UMEM frames: one ring's worth receives, the rest send
+#define XDP_RING_SIZE 2048
+#define XDP_BATCH 64             // Datagrams per send call
+#define XDP_PEERS 256            // Learned link-layer addresses
+#define XDP_IP_OFF ETH_HLEN
+#define XDP_UDP_OFF (XDP_IP_OFF + 20)
+#define XDP_HDR_LEN (XDP_UDP_OFF + 8) // Ethernet, IPv4 without options, UDP
+
+// One of the four rings shared with the kernel. We produce into the fill
+// and TX rings and consume from the RX and completion rings.
+struct xdp_ring {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *desc;
+    void *map;
+    size_t map_len;
+};
+
+// Where replies to a peer go on the wire, learned from its last datagram
+struct xdp_peer {
+    uint32_t ip;                 // Network order, 0 for a free slot
+    uint32_t local_ip;           // Our address as the peer used it
+    uint8_t mac[ETH_ALEN];       // Peer, or the router in front of it
+    uint8_t local_mac[ETH_ALEN];
+};
+
+struct sham_xdp {
+    struct sham_io io;
+    char ifname[IF_NAMESIZE];
+    uint32_t queue;
+    int flags;
+    int active;                  // AF_XDP path is up
+    char error[128];
+    uint16_t port;               // Network order
+
+    int epfd;                    // What the library polls: both sockets below
+    int udp_fd;
+    int xsk_fd;
+    int map_fd;
+    int prog_fd;
+    int link_fd;                 // Keeps the program attached; closing it detaches
+    uint8_t *umem;
+    struct xdp_ring fill;
+    struct xdp_ring comp;
+    struct xdp_ring rx;
+    struct xdp_ring tx;
+    uint64_t free_frames[XDP_FRAMES - XDP_RING_SIZE]; // Send frames not in the TX ring
+    unsigned nfree;
+    uint16_t ip_id;
+    struct xdp_peer peers[XDP_PEERS];
+    struct sham_xdp_stats stats;
+};
+
+static int sys_bpf(int cmd, union bpf_attr *attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int xdp_fail(struct sham_xdp *x, const char *what) {
+    snprintf(x->error, sizeof(x->error), "%s: %s", what, strerror(errno));
+    return -1;
+}
+
+// --- XDP program ---
+
+// Hand-assembled equivalent of:
+//
+//   if (eth + ip + udp past data_end) return XDP_PASS;
+//   if (ethertype != IPv4 || ihl != 5 || fragment || proto != UDP) return XDP_PASS;
+//   if (udp.dest != port) return XDP_PASS;
+//   return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS);
+//
+// A queue without a socket in the map passes its traffic to the kernel,
+// where the fallback socket picks it up.
+static int xdp_load_prog(struct sham_xdp *x) {
+    struct bpf_insn p[32];
+    int n = 0, jumps[8], nj = 0;
+#define EMIT(c, d, s, o, i) \
+    p[n++] = (struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) }
+#define TO_PASS() jumps[nj++] = n - 1
+
+    EMIT(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, data), 0);
+    EMIT(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_1, offsetof(struct xdp_md, data_end), 0);
+    EMIT(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_4, BPF_REG_1, offsetof(struct xdp_md, rx_queue_index), 0);
+    EMIT(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_5, BPF_REG_2, 0, 0);
+    EMIT(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_5, 0, 0, XDP_HDR_LEN);
+    EMIT(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_5, BPF_REG_3, 0, 0);
+    TO_PASS();
+    EMIT(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_0, BPF_REG_2, 12, 0);
+    EMIT(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0, htons(ETH_P_IP));
+    TO_PASS();
+    EMIT(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_0, BPF_REG_2, XDP_IP_OFF, 0);
+    EMIT(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0, 0x45);
+    TO_PASS();
+    EMIT(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_0, BPF_REG_2, XDP_IP_OFF + 6, 0);
+    EMIT(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_0, 0, 0, htons(0x3fff));
+    EMIT(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0, 0);
+    TO_PASS();
+    EMIT(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_0, BPF_REG_2, XDP_IP_OFF + 9, 0);
+    EMIT(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0, IPPROTO_UDP);
+    TO_PASS();
+    EMIT(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_0, BPF_REG_2, XDP_UDP_OFF + 2, 0);
+    EMIT(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0, x->port);
+    TO_PASS();
+    EMIT(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, x->map_fd);
+    EMIT(0, 0, 0, 0, 0);
+    EMIT(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_4, 0, 0);
+    EMIT(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS);
+    EMIT(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map);
+    EMIT(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+    int pass = n;
+    EMIT(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS);
+    EMIT(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+    for (int i = 0; i < nj; i++) p[jumps[i]].off = pass - jumps[i] - 1;
+#undef EMIT
+#undef TO_PASS
+
+    union bpf_attr a;
+    memset(&a, 0, sizeof(a));
+    a.prog_type = BPF_PROG_TYPE_XDP;
+    a.insns = (uintptr_t)p;
+    a.insn_cnt = n;
+    a.license = (uintptr_t)"GPL";
+    x->prog_fd = sys_bpf(BPF_PROG_LOAD, &a);
+    return x->prog_fd < 0 ? xdp_fail(x, "XDP program load") : 0;
+}
+
+// --- Setup ---
+
+static int ring_map(struct sham_xdp *x, struct xdp_ring *r, const struct xdp_ring_offset *off, size_t desc_size,
+                    uint64_t pgoff) {
+    r->map_len = off->desc + XDP_RING_SIZE * desc_size;
+    r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, x->xsk_fd, pgoff);
+    if (r->map == MAP_FAILED) {
+        r->map = NULL;
+        return xdp_fail(x, "ring mmap");
+    }
+    r->producer = (uint32_t *)((char *)r->map + off->producer);
+    r->consumer = (uint32_t *)((char *)r->map + off->consumer);
+    r->flags = (uint32_t *)((char *)r->map + off->flags);
+    r->desc = (char *)r->map + off->desc;
+    return 0;
+}
+
+// AF_XDP socket and UMEM, then the map, the program and the attachment
+static int xdp_setup(struct sham_xdp *x) {
+    unsigned ifindex = if_nametoindex(x->ifname);
+    if (ifindex == 0) return xdp_fail(x, x->ifname);
+
+    x->xsk_fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (x->xsk_fd < 0) return xdp_fail(x, "AF_XDP socket");
+
+    x->umem = mmap(NULL, (size_t)XDP_FRAMES * XDP_FRAME_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (x->umem == MAP_FAILED) {
+        x->umem = NULL;
+        return xdp_fail(x, "UMEM");
+    }
+    struct xdp_umem_reg reg = {
+        .addr = (uintptr_t)x->umem,
+        .len = (uint64_t)XDP_FRAMES * XDP_FRAME_SIZE,
+        .chunk_size = XDP_FRAME_SIZE,
+    };
+    if (setsockopt(x->xsk_fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0) return xdp_fail(x, "UMEM register");
+
+    int size = XDP_RING_SIZE;
+    if (setsockopt(x->xsk_fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(x->xsk_fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(x->xsk_fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(x->xsk_fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) < 0) {
+        return xdp_fail(x, "ring size");
+    }
+    struct xdp_mmap_offsets off;
+    socklen_t off_len = sizeof(off);
+    if (getsockopt(x->xsk_fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &off_len) < 0) return xdp_fail(x, "ring offsets");
+    if (ring_map(x, &x->fill, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) < 0 ||
+        ring_map(x, &x->comp, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) < 0 ||
+        ring_map(x, &x->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) < 0 ||
+        ring_map(x, &x->tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) < 0) {
+        return -1;
+    }
+
+    // Lend the first ring's worth of frames to the kernel for receiving;
+    // a received frame goes straight back once its payload is copied out
+    uint64_t *fill = x->fill.desc;
+    for (uint32_t i = 0; i < XDP_RING_SIZE; i++) fill[i] = (uint64_t)i * XDP_FRAME_SIZE;
+    __atomic_store_n(x->fill.producer, XDP_RING_SIZE, __ATOMIC_RELEASE);
+    x->nfree = 0;
+    for (uint32_t i = XDP_RING_SIZE; i < XDP_FRAMES; i++) x->free_frames[x->nfree++] = (uint64_t)i * XDP_FRAME_SIZE;
+
+    struct sockaddr_xdp sxdp = {
+        .sxdp_family = AF_XDP,
+        .sxdp_flags = XDP_USE_NEED_WAKEUP | ((x->flags & SHAM_XDP_SKB) ? XDP_COPY : 0),
+        .sxdp_ifindex = ifindex,
+        .sxdp_queue_id = x->queue,
+    };
+    if (bind(x->xsk_fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0) return xdp_fail(x, "AF_XDP bind");
+
+    union bpf_attr a;
+    memset(&a, 0, sizeof(a));
+    a.map_type = BPF_MAP_TYPE_XSKMAP;
+    a.key_size = sizeof(uint32_t);
+    a.value_size = sizeof(uint32_t);
+    a.max_entries = x->queue + 1;
+    x->map_fd = sys_bpf(BPF_MAP_CREATE, &a);
+    if (x->map_fd < 0) return xdp_fail(x, "XSKMAP");
+
+    memset(&a, 0, sizeof(a));
+    a.map_fd = x->map_fd;
+    a.key = (uintptr_t)&x->queue;
+    a.value = (uintptr_t)&x->xsk_fd;
+    if (sys_bpf(BPF_MAP_UPDATE_ELEM, &a) < 0) return xdp_fail(x, "XSKMAP update");
+
+    if (xdp_load_prog(x) < 0) return -1;
+
+    memset(&a, 0, sizeof(a));
+    a.link_create.prog_fd = x->prog_fd;
+    a.link_create.target_ifindex = ifindex;
+    a.link_create.attach_type = BPF_XDP;
+    a.link_create.flags = (x->flags & SHAM_XDP_SKB) ? XDP_FLAGS_SKB_MODE : 0;
+    x->link_fd = sys_bpf(BPF_LINK_CREATE, &a);
+    if (x->link_fd < 0) return xdp_fail(x, "XDP attach");
+    return 0;
+}
+
+// Undoes whatever part of xdp_setup succeeded
+static void xdp_teardown(struct sham_xdp *x) {
+    int *fds[] = { &x->link_fd, &x->prog_fd, &x->map_fd };
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (*fds[i] >= 0) close(*fds[i]);
+        *fds[i] = -1;
+    }
+    struct xdp_ring *rings[] = { &x->fill, &x->comp, &x->rx, &x->tx };
+    for (size_t i = 0; i < sizeof(rings) / sizeof(rings[0]); i++) {
+        if (rings[i]->map) munmap(rings[i]->map, rings[i]->map_len);
+        memset(rings[i], 0, sizeof(*rings[i]));
+    }
+    if (x->xsk_fd >= 0) close(x->xsk_fd);
+    x->xsk_fd = -1;
+    if (x->umem) munmap(x->umem, (size_t)XDP_FRAMES * XDP_FRAME_SIZE);
+    x->umem = NULL;
+    x->active = 0;
+}
+
+// --- Peer addresses ---
+
+static struct xdp_peer *peer_slot(struct sham_xdp *x, uint32_t ip) {
+    unsigned h = (ip * 2654435761u) >> 24;
+    for (unsigned i = 0; i < XDP_PEERS; i++) {
+        struct xdp_peer *p = &x->peers[(h + i) % XDP_PEERS];
+        if (p->ip == ip || p->ip == 0) return p;
+    }
+    return &x->peers[h % XDP_PEERS]; // Full: evict
+}
+
+// --- Data path ---
+
+// One's complement sum of n bytes in network order, added to 'sum'
+static uint32_t csum_add(uint32_t sum, const uint8_t *b, size_t n) {
+    for (; n > 1; b += 2, n -= 2) sum += (b[0] << 8) | b[1];
+    if (n) sum += b[0] << 8;
+    return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum) {
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+// Over a header whose checksum field is zero this gives the checksum; over
+// one carrying a correct checksum it gives 0
+static uint16_t ip_checksum(const uint8_t *ip) {
+    return csum_fold(csum_add(0, ip, 20));
+}
+
+// The same for the UDP datagram and the IPv4 pseudo-header in front of it
+static uint16_t udp_checksum(const uint8_t *ip, const uint8_t *udp, uint16_t udp_len) {
+    uint32_t sum = csum_add(0, ip + 12, 8); // Source and destination address
+    sum += IPPROTO_UDP + udp_len;
+    return csum_fold(csum_add(sum, udp, udp_len));
+}
+
+// Copies the UDP payload of a steered frame into d and remembers how to
+// reach the sender. Returns 0 for a frame that is not a whole datagram or
+// fails its checksums; nothing in front of the socket has checked them.
+static int xdp_parse(struct sham_xdp *x, const uint8_t *f, uint32_t len, struct sham_datagram *d) {
+    uint16_t udp_len, sum;
+    if (len < XDP_HDR_LEN) return 0;
+    memcpy(&udp_len, f + XDP_UDP_OFF + 4, 2);
+    udp_len = ntohs(udp_len);
+    if (udp_len < 8 || XDP_UDP_OFF + (uint32_t)udp_len > len) return 0;
+    memcpy(&sum, f + XDP_UDP_OFF + 6, 2);
+    if (ip_checksum(f + XDP_IP_OFF) != 0 ||
+        (sum != 0 && udp_checksum(f + XDP_IP_OFF, f + XDP_UDP_OFF, udp_len) != 0)) { // 0: none sent
+        // Usually a local sender whose checksum offload never finished them
+        if (x->stats.rx_bad_csum++ == 0) {
+            log_event("XDP BAD CHECKSUM: dropping frames with a bad checksum; a sender behind a veth pair "
+                      "needs TX checksum offload off on its side (ethtool -K <peer> tx off)\n");
+        }
+        return 0;
+    }
+
+    size_t n = udp_len - 8u < d->len ? udp_len - 8u : d->len;
+    memcpy(d->data, f + XDP_HDR_LEN, n);
+    d->len = n;
+    memset(d->addr, 0, sizeof(*d->addr));
+    d->addr->sin_family = AF_INET;
+    memcpy(&d->addr->sin_addr.s_addr, f + XDP_IP_OFF + 12, 4);
+    memcpy(&d->addr->sin_port, f + XDP_UDP_OFF, 2);
+
+    struct xdp_peer *p = peer_slot(x, d->addr->sin_addr.s_addr);
+    p->ip = d->addr->sin_addr.s_addr;
+    memcpy(&p->local_ip, f + XDP_IP_OFF + 16, 4);
+    memcpy(p->mac, f + ETH_ALEN, ETH_ALEN);
+    memcpy(p->local_mac, f, ETH_ALEN);
+    return 1;
+}
+
+static void xdp_build(struct sham_xdp *x, const struct xdp_peer *p, uint8_t *f, const struct sham_datagram *d) {
+    uint16_t v;
+    memcpy(f, p->mac, ETH_ALEN);
+    memcpy(f + ETH_ALEN, p->local_mac, ETH_ALEN);
+    v = htons(ETH_P_IP);
+    memcpy(f + 12, &v, 2);
+
+    uint8_t *ip = f + XDP_IP_OFF;
+    ip[0] = 0x45;
+    ip[1] = 0;
+    v = htons(20 + 8 + d->len);
+    memcpy(ip + 2, &v, 2);
+    v = htons(x->ip_id++);
+    memcpy(ip + 4, &v, 2);
+    v = htons(0x4000); // Don't fragment
+    memcpy(ip + 6, &v, 2);
+    ip[8] = 64;
+    ip[9] = IPPROTO_UDP;
+    memset(ip + 10, 0, 2);
+    memcpy(ip + 12, &p->local_ip, 4);
+    memcpy(ip + 16, &d->addr->sin_addr.s_addr, 4);
+    v = htons(ip_checksum(ip));
+    memcpy(ip + 10, &v, 2);
+
+    uint8_t *udp = f + XDP_UDP_OFF;
+    memcpy(udp, &x->port, 2);
+    memcpy(udp + 2, &d->addr->sin_port, 2);
+    v = htons(8 + d->len);
+    memcpy(udp + 4, &v, 2);
+    memset(udp + 6, 0, 2);
+    memcpy(udp + 8, d->data, d->len);
+    v = udp_checksum(ip, udp, 8 + d->len);
+    v = htons(v ? v : 0xffff); // 0 would mean no checksum
+    memcpy(udp + 6, &v, 2);
+}
+
+// Frames the kernel has finished sending go back on the free stack
+static void xdp_reclaim(struct sham_xdp *x) {
+    uint32_t cons = *x->comp.consumer;
+    uint32_t avail = __atomic_load_n(x->comp.producer, __ATOMIC_ACQUIRE) - cons;
+    const uint64_t *addrs = x->comp.desc;
+    for (; avail > 0; avail--) x->free_frames[x->nfree++] = addrs[cons++ & (XDP_RING_SIZE - 1)];
+    __atomic_store_n(x->comp.consumer, cons, __ATOMIC_RELEASE);
+}
+
+// --- Backend ops ---
+
+static int xdp_open(void *ctx, uint16_t port) {
+    struct sham_xdp *x = ctx;
+    if (port == 0 || x->epfd >= 0) {
+        errno = EINVAL; // Serves one listening port
+        return -1;
+    }
+    x->port = htons(port);
+    x->udp_fd = sham_udp_io.open(NULL, port);
+    if (x->udp_fd < 0) return -1;
+    x->epfd = epoll_create1(0);
+    struct epoll_event ev = { .events = EPOLLIN };
+    if (x->epfd < 0 || epoll_ctl(x->epfd, EPOLL_CTL_ADD, x->udp_fd, &ev) < 0) {
+        int err = errno;
+        if (x->epfd >= 0) close(x->epfd);
+        close(x->udp_fd);
+        x->epfd = x->udp_fd = -1;
+        errno = err;
+        return -1;
+    }
+
+    if (xdp_setup(x) == 0 && epoll_ctl(x->epfd, EPOLL_CTL_ADD, x->xsk_fd, &ev) == 0) {
+        x->active = 1;
+        log_event("XDP ON %s QUEUE=%u\n", x->ifname, x->queue);
+    } else {
+        if (!x->error[0]) xdp_fail(x, "epoll");
+        xdp_teardown(x);
+        log_event("XDP FALLBACK %s\n", x->error);
+    }
+    return x->epfd;
+}
+
+static void xdp_close(void *ctx, int fd) {
+    struct sham_xdp *x = ctx;
+    (void)fd;
+    xdp_teardown(x);
+    close(x->udp_fd);
+    close(x->epfd);
+    x->udp_fd = x->epfd = -1;
+}
+
+// Datagrams to a peer we have heard from over AF_XDP go out on the TX
+// ring; the rest, or any that find the ring or the frames exhausted, take
+// the fallback socket
+static int xdp_send(void *ctx, int fd, struct sham_datagram *d, int n) {
+    struct sham_xdp *x = ctx;
+    struct sham_datagram slow[XDP_BATCH];
+    int nslow = 0;
+    (void)fd;
+    if (n > XDP_BATCH) n = XDP_BATCH;
+
+    if (x->active) {
+        xdp_reclaim(x);
+        struct xdp_desc *descs = x->tx.desc;
+        uint32_t prod = *x->tx.producer;
+        uint32_t room = XDP_RING_SIZE - (prod - __atomic_load_n(x->tx.consumer, __ATOMIC_ACQUIRE));
+        uint32_t queued = 0;
+        for (int i = 0; i < n; i++) {
+            struct xdp_peer *p = peer_slot(x, d[i].addr->sin_addr.s_addr);
+            if (p->ip != d[i].addr->sin_addr.s_addr || room == 0 || x->nfree == 0 ||
+                d[i].len > XDP_FRAME_SIZE - XDP_HDR_LEN) {
+                slow[nslow++] = d[i];
+                continue;
+            }
+            uint64_t addr = x->free_frames[--x->nfree];
+            xdp_build(x, p, x->umem + addr, &d[i]);
+            descs[prod & (XDP_RING_SIZE - 1)] = (struct xdp_desc){ .addr = addr, .len = XDP_HDR_LEN + d[i].len };
+            prod++;
+            room--;
+            queued++;
+        }
+        if (queued > 0) {
+            __atomic_store_n(x->tx.producer, prod, __ATOMIC_RELEASE);
+            if (__atomic_load_n(x->tx.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP) {
+                sendto(x->xsk_fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+            }
+            x->stats.tx_xsk += queued;
+        }
+    } else {
+        memcpy(slow, d, n * sizeof(*d));
+        nslow = n;
+    }
+
+    for (int sent = 0; sent < nslow; ) {
+        int r = sham_udp_io.send(NULL, x->udp_fd, slow + sent, nslow - sent);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            r = 1; // Drop the datagram that failed, like a lost packet
+        }
+        sent += r;
+    }
+    x->stats.tx_udp += nslow;
+    return n;
+}
+
+static int xdp_recv(void *ctx, int fd, struct sham_datagram *d, int n) {
+    struct sham_xdp *x = ctx;
+    int r = 0;
+    (void)fd;
+
+    if (x->active) {
+        const struct xdp_desc *descs = x->rx.desc;
+        uint64_t *fill = x->fill.desc;
+        uint32_t cons = *x->rx.consumer;
+        uint32_t avail = __atomic_load_n(x->rx.producer, __ATOMIC_ACQUIRE) - cons;
+        uint32_t prod = *x->fill.producer;
+        for (; r < n && avail > 0; avail--) {
+            const struct xdp_desc *desc = &descs[cons++ & (XDP_RING_SIZE - 1)];
+            if (xdp_parse(x, x->umem + desc->addr, desc->len, &d[r])) r++;
+            fill[prod++ & (XDP_RING_SIZE - 1)] = desc->addr & ~(uint64_t)(XDP_FRAME_SIZE - 1);
+        }
+        __atomic_store_n(x->rx.consumer, cons, __ATOMIC_RELEASE);
+        __atomic_store_n(x->fill.producer, prod, __ATOMIC_RELEASE);
+        if (__atomic_load_n(x->fill.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP) {
+            recvfrom(x->xsk_fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+        }
+        x->stats.rx_xsk += r;
+    }
+
+    if (r < n) {
+        int u = sham_udp_io.recv(NULL, x->udp_fd, d + r, n - r);
+        if (u > 0) {
+            r += u;
+            x->stats.rx_udp += u;
+        }
+    }
+    if (r == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return r;
+}
+
+// --- API ---
+
+struct sham_xdp *sham_xdp_new(const char *ifname, uint32_t queue, int flags) {
+    if (strlen(ifname) >= IF_NAMESIZE) {
+        errno = EINVAL;
+        return NULL;
+    }
+    struct sham_xdp *x = calloc(1, sizeof(*x));
+    if (!x) return NULL;
+    strcpy(x->ifname, ifname);
+    x->queue = queue;
+    x->flags = flags;
+    x->epfd = x->udp_fd = x->xsk_fd = -1;
+    x->map_fd = x->prog_fd = x->link_fd = -1;
+    x->io = (struct sham_io){
+        .ctx = x,
+        .now_us = sham_udp_io.now_us,
+        .wall_us = sham_udp_io.wall_us,
+        .open = xdp_open,
+        .close = xdp_close,
+        .send = xdp_send,
+        .recv = xdp_recv,
+    };
+    return x;
+}
+
+const struct sham_io *sham_xdp_io(struct sham_xdp *x) {
+    return &x->io;
+}
+
+const char *sham_xdp_error(const struct sham_xdp *x) {
+    if (x->active) return NULL;
+    return x->error[0] ? x->error : "not open";
+}
+
+void sham_xdp_stats(const struct sham_xdp *x, struct sham_xdp_stats *stats) {
+    *stats = x->stats;
+}
+
+// Call after the listener using it has been closed
+void sham_xdp_free(struct sham_xdp *x) {
+    if (x->epfd >= 0) xdp_close(x, x->epfd);
+    free(x);
+}
@@ -0,0 +1,35 @@
+#ifndef XDP_H
+#define XDP_H
+
+#include "sham.h"
+#include <net/if.h>
+
+// AF_XDP backend for a listener (built with make XDP=1, Linux 5.9+, needs
+// CAP_NET_ADMIN and CAP_BPF or root). An XDP program on the interface
+// steers IPv4 UDP datagrams for the listener's port, arriving on one
+// receive queue, into an AF_XDP socket whose frames live in a UMEM shared
+// with the kernel. Replies go out on the same socket's TX ring.
+//
+// Everything else stays on a normal UDP socket bound to the same port:
+// traffic on other queues, fragments and IP options, and replies to a
+// peer whose MAC address has not been seen yet. If the XDP path cannot
+// be set up at all the backend runs on that socket alone.
+#define SHAM_XDP_SKB 0x1         // Generic (SKB) mode: any driver, veth included, always copies
+
+struct sham_xdp_stats {
+    uint64_t rx_xsk;             // Datagrams through the AF_XDP rings
+    uint64_t rx_udp;             // Datagrams through the fallback socket
+    uint64_t tx_xsk;
+    uint64_t tx_udp;
+    uint64_t rx_bad_csum;        // AF_XDP frames dropped for a bad IP or UDP checksum
+};
+
+struct sham_xdp;
+
+struct sham_xdp *sham_xdp_new(const char *ifname, uint32_t queue, int flags);
+const struct sham_io *sham_xdp_io(struct sham_xdp *x);
+const char *sham_xdp_error(const struct sham_xdp *x); // Why AF_XDP is not in use, NULL when it is
+void sham_xdp_stats(const struct sham_xdp *x, struct sham_xdp_stats *stats);
+void sham_xdp_free(struct sham_xdp *x);
+
+#endif // XDP_H